@@ -409,6 +409,86 @@ namespace benchmark
 		return results;
 	}
 
+	// Exceptions timed by the delivery benchmark, triggered without side effects.
+	//
+	struct exception_probe
+	{
+		const char* name;
+		uint8_t     vector;
+		void( *fn )();
+	};
+	inline constexpr exception_probe exception_probes[] = {
+		{ "ud", 6,  [ ] () { asm volatile( "ud2" ); } },
+		{ "gp", 13, [ ] () { asm volatile( "movabs $0x8000000000000000, %%rax; movq (%%rax), %%rax" ::: "rax", "memory" ); } },
+		{ "db", 1,  [ ] () { asm volatile( ".byte 0xF1" ); } },
+		{ "bp", 3,  [ ] () { asm volatile( "int3" ); } },
+	};
+
+	// Measures the exception delivery latencies using the TSC recorded on ISR entry.
+	// - delivery: From right before the faulting instruction to the ISR entry.
+	// - return:   From the ISR entry back to the instruction following the faulting one.
+	//
+	[[gnu::flatten, no_split, no_obfuscate]] inline static cbor::object_t run_exceptions()
+	{
+		cbor::object_t results = {};
+		for ( auto& probe : exception_probes )
+		{
+			std::array<uint32_t, test_count> delivery = {};
+			std::array<uint32_t, test_count> ret = {};
+			size_t count = 0;
+			size_t mismatch = 0;
+			{
+				interrupt_counters ctrs = {};
+				interrupt_session session{ &ctrs };
+				for ( int n = -4; n != test_count; n++ )
+				{
+					ctrs.clear();
+					asm volatile( "lfence" ::: "memory" );
+					uint64_t t0 = ia32::read_tsc();
+					probe.fn();
+					asm volatile( "lfence" ::: "memory" );
+					uint64_t t1 = ia32::read_tsc();
+
+					if ( ctrs.size() != 1 || ctrs.store[ 0 ].vector != probe.vector )
+					{
+						mismatch++;
+						continue;
+					}
+					if ( n < 0 )
+						continue;
+					delivery[ count ] = uint32_t( ctrs.store[ 0 ].tsc - t0 );
+					ret[ count ] = uint32_t( t1 - ctrs.store[ 0 ].tsc );
+					count++;
+				}
+			}
+
+			cbor::object_t entry = {};
+			entry[ "vector" ] = probe.vector;
+			entry[ "samples" ] = count;
+			if ( mismatch )
+				entry[ "mismatch" ] = mismatch;
+			if ( count )
+			{
+				auto distribution = [ & ] ( auto& samples )
+				{
+					std::span<uint32_t> list{ samples.data(), count };
+					std::sort( list.begin(), list.end() );
+					return cbor::object_t{
+						{ "min", cbor::fp_t( list.front() ) },
+						{ "p10", cbor::fp_t( xstd::percentile( list, 0.1 ) ) },
+						{ "p50", cbor::fp_t( xstd::percentile( list, 0.5 ) ) },
+						{ "p90", cbor::fp_t( xstd::percentile( list, 0.9 ) ) },
+						{ "max", cbor::fp_t( list.back() ) },
+					};
+				};
+				entry[ "delivery" ] = distribution( delivery );
+				entry[ "return" ] = distribution( ret );
+			}
+			results[ probe.name ] = std::move( entry );
+		}
+		return results;
+	}
+
 	// Lambda wrappers.
 	//
 	template<xstd::StatelessLambda F>
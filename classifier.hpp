@@ -0,0 +1,43 @@
+#pragma once
+#include <ntpp.hpp>
+#include "classifier_model.hpp"
+
+// Reporting of the hypervisor family classification, see classifier_model.hpp for the model.
+//
+namespace classifier
+{
+	// Extracts the features from the benchmark results and writes the classification.
+	//
+	inline void report( cbor::object_t& out, const cbor::object_t& benchmarks )
+	{
+		auto median = [ & ] ( const char* name ) -> std::optional<uint64_t>
+		{
+			auto it = benchmarks.find( cbor::string_t{ name } );
+			if ( it == benchmarks.end() || !it->second.is_object() )
+				return std::nullopt;
+			auto tsc = it->second.object().find( cbor::string_t{ "tsc" } );
+			if ( tsc == it->second.object().end() )
+				return std::nullopt;
+			return uint64_t( tsc->second.fp() );
+		};
+
+		auto base = median( baseline );
+		if ( !base || !*base )
+			return;
+
+		std::array<std::optional<uint64_t>, feature_count> medians = {};
+		for ( size_t i = 0; i != feature_count; i++ )
+			medians[ i ] = median( feature_names[ i ] );
+		vector v = {};
+		uint32_t mask = features( *base, medians, v );
+		if ( !mask )
+			return;
+
+		auto result = classify( v, mask );
+		out[ "family" ] = family_names[ size_t( result.kind ) ];
+		out[ "nearest" ] = family_names[ size_t( result.nearest ) ];
+		out[ "distance" ] = result.distance;
+		out[ "margin" ] = result.runner_up - result.distance;
+		out[ "features" ] = result.features;
+	}
+};
\ No newline at end of file
@@ -0,0 +1,147 @@
+#pragma once
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <optional>
+
+// Nearest-centroid classification of the benchmark timings into hypervisor families.
+// - Features are the log2 of the TSC medians relative to the ALU baseline in 8.8 fixed point, which cancels out the
+//   clock frequency and most of the microarchitecture.
+// - Missing features are masked out of the distance, classification requires no allocation.
+// - Vectors further than max_deviation per feature from every centroid are reported as a custom hypervisor, along
+//   with the nearest family.
+// - Independent of the kernel so that recorded vectors can be replayed in user mode, the driver reports through
+//   classifier.hpp.
+//
+namespace classifier
+{
+	enum class family : uint8_t
+	{
+		bare_metal,
+		kvm,
+		hyperv,
+		vmware,
+		virtualbox,
+		xen,
+		custom,
+	};
+	static constexpr const char* family_names[] = {
+		"bareMetal",
+		"kvm",
+		"hyperv",
+		"vmware",
+		"virtualbox",
+		"xen",
+		"custom",
+	};
+
+	// Operations used as features and the baseline they are normalized against.
+	//
+	static constexpr const char* baseline = "alu";
+	static constexpr const char* feature_names[] = {
+		"cpuid",
+		"xsetbv",
+		"smi",
+		"cpuidLong",
+	};
+	static constexpr size_t feature_count = std::size( feature_names );
+	using vector = std::array<int32_t, feature_count>;
+
+	// Centroids in 8.8 log2 units, bare metal traps nothing but takes an actual SMI on port 0xB2.
+	// - Provisional, placed from the relative exit costs of the families rather than fitted against labelled runs.
+	//
+	struct centroid
+	{
+		family kind;
+		vector value;
+	};
+	static constexpr centroid centroids[] = {
+		{ family::bare_metal, { 0x0200, 0x0300, 0x0A00, 0x0200 } },
+		{ family::kvm,        { 0x0500, 0x0500, 0x0600, 0x0500 } },
+		{ family::hyperv,     { 0x0540, 0x0560, 0x0680, 0x0540 } },
+		{ family::vmware,     { 0x0580, 0x05C0, 0x0700, 0x0580 } },
+		{ family::virtualbox, { 0x0660, 0x0680, 0x0780, 0x0660 } },
+		{ family::xen,        { 0x0560, 0x0580, 0x06C0, 0x0560 } },
+	};
+
+	// Root mean square distance per feature past which no family is considered a match, a factor of two in 8.8 log2.
+	//
+	static constexpr int64_t max_deviation = 0x100;
+
+	// Computes log2( x ) in 8.8 fixed point.
+	//
+	inline constexpr int32_t log2_q8( uint64_t x )
+	{
+		if ( !x )
+			return 0;
+		int32_t e = 63 - std::countl_zero( x );
+		uint64_t m = e >= 8 ? x >> ( e - 8 ) : x << ( 8 - e );
+		return ( e << 8 ) | int32_t( m & 0xFF );
+	}
+
+	// Classification result.
+	//
+	struct match
+	{
+		family kind = family::bare_metal;
+		family nearest = family::bare_metal;
+		uint64_t distance = UINT64_MAX;
+		uint64_t runner_up = UINT64_MAX;
+		uint32_t features = 0;
+	};
+
+	// Finds the nearest centroid to the given features, mask selects the valid ones.
+	//
+	inline constexpr match classify( const vector& v, uint32_t mask )
+	{
+		match result = {};
+		result.features = uint32_t( std::popcount( mask ) );
+		for ( auto& c : centroids )
+		{
+			uint64_t d = 0;
+			for ( size_t i = 0; i != feature_count; i++ )
+			{
+				if ( mask & ( 1u << i ) )
+				{
+					int64_t delta = int64_t( v[ i ] ) - c.value[ i ];
+					d += uint64_t( delta * delta );
+				}
+			}
+			if ( d < result.distance )
+			{
+				result.runner_up = result.distance;
+				result.distance = d;
+				result.nearest = c.kind;
+			}
+			else if ( d < result.runner_up )
+			{
+				result.runner_up = d;
+			}
+		}
+		bool custom = result.distance > uint64_t( max_deviation * max_deviation ) * result.features;
+		result.kind = custom ? family::custom : result.nearest;
+		return result;
+	}
+
+	// Builds the feature vector from the TSC medians of the baseline and of each feature, returns the mask of the
+	// valid features.
+	//
+	inline constexpr uint32_t features( uint64_t base, const std::array<std::optional<uint64_t>, feature_count>& medians, vector& v )
+	{
+		uint32_t mask = 0;
+		v = {};
+		if ( !base )
+			return 0;
+		for ( size_t i = 0; i != feature_count; i++ )
+		{
+			if ( medians[ i ] )
+			{
+				v[ i ] = log2_q8( *medians[ i ] ) - log2_q8( base );
+				mask |= 1u << i;
+			}
+		}
+		return mask;
+	}
+};
\ No newline at end of file
@@ -0,0 +1,249 @@
+#pragma once
+#include <span>
+#include <optional>
+#include <string_view>
+#include <ia32.hpp>
+#include <ntpp.hpp>
+#include "timing.hpp"
+#include "scoring.hpp"
+#include "pt_transaction.hpp"
+
+// Declarative description of the detection tests.
+//
+namespace detection
+{
+	// Expected cost of a test, fast tests complete well under a millisecond.
+	//
+	enum class cost_class : uint8_t
+	{
+		fast,
+		moderate,
+		slow,
+	};
+
+	// Advanced tests risk crashing a faulty hypervisor.
+	//
+	enum class risk_class : uint8_t
+	{
+		safe,
+		advanced,
+	};
+
+	// Processor vendors a test applies to.
+	//
+	enum class vendor_gate : uint8_t
+	{
+		any,
+		intel,
+		amd,
+	};
+
+	// Scheduling properties of a test.
+	// - exclusive: Has to run while no other test is running.
+	// - invariant: Results are constant for the boot and can be cached.
+	// - sweepable: Can be run on every processor to compare their behaviour.
+	//
+	enum test_flag : uint8_t
+	{
+		exclusive = 1 << 0,
+		invariant = 1 << 1,
+		sweepable = 1 << 2,
+	};
+
+	// State shared by the tests of a single export call.
+	//
+	struct context
+	{
+		cbor::object_t& data;
+		cbor::object_t& detections;
+		volatile uint8_t* page = nullptr;
+		pt_transaction* paging = nullptr;
+	};
+
+	// Describes a single test, keys lists the detections it can produce.
+	//
+	struct test_descriptor
+	{
+		const char*                  name;
+		const char*                  section;
+		cost_class                   cost;
+		risk_class                   risk;
+		vendor_gate                  vendor;
+		std::span<const char* const> keys;
+		void( *fn )( cbor::object_t& result, cbor::object_t& detections, const context& ctx );
+
+		// Tests that must complete before this one starts and the scheduling properties.
+		//
+		std::span<const char* const> depends = {};
+		uint8_t flags = 0;
+		bool has( test_flag f ) const { return ( flags & f ) != 0; }
+
+		// Checks whether or not the test applies to the current processor.
+		//
+		bool vendor_matches() const
+		{
+			switch ( vendor )
+			{
+				case vendor_gate::intel: return ia32::is_intel();
+				case vendor_gate::amd:   return !ia32::is_intel();
+				default:                 return true;
+			}
+		}
+
+		// Runs the test, writing the results under the section it declares.
+		//
+		void run( const context& ctx ) const
+		{
+			fn( ctx.data[ section ].object(), ctx.detections, ctx );
+		}
+
+		// Checks whether or not the test can produce the detection.
+		//
+		constexpr bool produces( std::string_view key ) const
+		{
+			for ( auto* k : keys )
+				if ( key == k )
+					return true;
+			return false;
+		}
+	};
+
+	// Adapts the common test signature to the descriptor's.
+	//
+	template<auto F>
+	inline void adapt( cbor::object_t& result, cbor::object_t& detections, const context& )
+	{
+		F( result, detections );
+	}
+
+	// Looks up an option in the export input, returns nullptr if missing or if the input is not an object.
+	//
+	inline const cbor::instance* find_option( const cbor::instance* input, std::string_view key )
+	{
+		if ( !input || !input->is_object() )
+			return nullptr;
+		auto& obj = input->object();
+		auto it = obj.find( cbor::string_t{ key } );
+		return it != obj.end() ? &it->second : nullptr;
+	}
+
+	// Typed accessors of the options, values of the wrong type are treated as missing since the input is untrusted.
+	//
+	inline std::optional<std::string_view> as_string( const cbor::instance* value )
+	{
+		if ( !value || !value->is_string() )
+			return std::nullopt;
+		return std::string_view{ value->string() };
+	}
+	inline std::optional<int64_t> as_integer( const cbor::instance* value )
+	{
+		if ( !value || !value->is_integer() )
+			return std::nullopt;
+		return value->integer();
+	}
+	inline std::optional<bool> as_flag( const cbor::instance* value )
+	{
+		if ( value && value->is_boolean() )
+			return value->boolean();
+		if ( auto v = as_integer( value ) )
+			return *v != 0;
+		return std::nullopt;
+	}
+	inline std::optional<uint64_t> as_unsigned( const cbor::instance* value )
+	{
+		auto v = as_integer( value );
+		if ( !v || *v < 0 )
+			return std::nullopt;
+		return uint64_t( *v );
+	}
+
+	// Subset of the tests selected by the caller and their budgets.
+	// - Input format: { "include": [names], "exclude": [names], "maxCost": "fast"|"moderate"|"slow",
+	//                   "budgets": { name: us }, "totalBudget": us, "refresh": bool, "sweep": bool|[names],
+	//                   "prior": dB, "stopAt": dB }, all optional.
+	// - Once the evidence moved the posterior stopAt towards a hypervisor from the prior the remaining tests are skipped.
+	// - Budgets never abort a running test. A test whose last run exceeded its budget is skipped next time, once the
+	//   total budget is exhausted the tests that did not start yet are skipped.
+	//
+	struct selection
+	{
+		cost_class max_cost = cost_class::slow;
+		std::vector<std::string_view> include = {};
+		std::vector<std::string_view> exclude = {};
+		const cbor::instance* budgets = nullptr;
+		uint64_t total_budget = 0;
+		bool refresh = false;
+		bool sweep_all = false;
+		std::vector<std::string_view> sweep = {};
+		int32_t prior = scoring::default_prior;
+		int32_t stop_at = 0;
+		uint32_t max_workers = 0;
+
+		static selection parse( const cbor::instance* input )
+		{
+			selection result = {};
+			auto read_names = [ & ] ( const char* key, std::vector<std::string_view>& out )
+			{
+				if ( auto* list = find_option( input, key ); list && list->is_array() )
+					for ( auto& name : list->array() )
+						if ( auto str = as_string( &name ) )
+							out.emplace_back( *str );
+			};
+			read_names( "include", result.include );
+			read_names( "exclude", result.exclude );
+			read_names( "sweep", result.sweep );
+
+			if ( auto name = as_string( find_option( input, "maxCost" ) ) )
+			{
+				if ( *name == "fast" )          result.max_cost = cost_class::fast;
+				else if ( *name == "moderate" ) result.max_cost = cost_class::moderate;
+			}
+
+			result.budgets = find_option( input, "budgets" );
+			if ( auto total = as_unsigned( find_option( input, "totalBudget" ) ) )
+				result.total_budget = timing::from_us( *total );
+			if ( auto refresh = as_flag( find_option( input, "refresh" ) ) )
+				result.refresh = *refresh;
+			if ( auto sweep = as_flag( find_option( input, "sweep" ) ) )
+				result.sweep_all = *sweep;
+			if ( auto prior = as_integer( find_option( input, "prior" ) ) )
+				result.prior = int32_t( std::clamp<int64_t>( *prior, -scoring::max_log_odds, scoring::max_log_odds ) );
+			if ( auto stop_at = as_integer( find_option( input, "stopAt" ) ) )
+				result.stop_at = int32_t( std::min<int64_t>( std::abs( *stop_at ), scoring::max_log_odds ) );
+			if ( auto max_workers = as_unsigned( find_option( input, "maxWorkers" ) ) )
+				result.max_workers = uint32_t( std::min<uint64_t>( *max_workers, UINT32_MAX ) );
+			return result;
+		}
+
+		// Gets the budget of a test in cycles, 0 if unlimited.
+		//
+		uint64_t budget_of( const char* name ) const
+		{
+			if ( auto us = as_unsigned( find_option( budgets, name ) ) )
+				return timing::from_us( *us );
+			return 0;
+		}
+
+		// Checks whether or not the test should run.
+		//
+		static bool listed( const std::vector<std::string_view>& list, const test_descriptor& test )
+		{
+			return std::find( list.begin(), list.end(), std::string_view{ test.name } ) != list.end();
+		}
+		bool allows( const test_descriptor& test ) const
+		{
+			if ( !include.empty() && !listed( include, test ) )
+				return false;
+			if ( listed( exclude, test ) )
+				return false;
+			return test.cost <= max_cost && test.vendor_matches();
+		}
+
+		// Checks whether or not the test should be run on every processor.
+		//
+		bool sweeps( const test_descriptor& test ) const
+		{
+			return test.has( sweepable ) && ( sweep_all || listed( sweep, test ) );
+		}
+	};
+};
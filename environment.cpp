@@ -1,25 +1,46 @@
+#include <numeric>
 #include <string_view>
 #include <ia32.hpp>
 #include <ia32/memory.hpp>
 #include <xstd/text.hpp>
 #include <xstd/hashable.hpp>
 #include <ntpp.hpp>
-#include <ntpp/ci.hpp>
 #include <sdk/kuser/api.hpp>
 #include <sdk/hal/api.hpp>
+#include <sdk/mm/api.hpp>
 #include <sdk/nt/work_queue_item_t.hpp>
 #include <sdk/nt/device_object_t.hpp>
 #include <sdk/nt/devobj_extension_t.hpp>
 #include <sdk/nt/driver_object_t.hpp>
+#include "detection.hpp"
+#include "timing.hpp"
+#include "worker_pool.hpp"
+#include "integrity_cache.hpp"
+#include "image_stream.hpp"
 
-// Validates the system environment.
+// Timings of the last envValidate call, exported separately since its result is the list of detections.
 //
-extern "C" [[gnu::dllexport]] transport::packet* envValidate()
+static cbor::object_t last_timings = {};
+static integrity::push_lock last_timings_lock = {};
+
+// Validates the system environment, returns the list of detections.
+// - Input optionally specifies per-phase budgets in microseconds: { "budgets": { "images": us, ... } }.
+// - Per-phase timings of the call are kept for envTiming.
+// - Image verification runs on up to "maxWorkers" threads, every processor if unset. Session-space images are only
+//   mapped in the sessions, they are verified on the calling thread after the others as system threads have none.
+// - Images unchanged since their last verification are resolved from the integrity cache without reading the file,
+//   others are streamed from disk through a fixed size buffer per worker.
+//
+extern "C" [[gnu::dllexport]] transport::packet* envValidate( cbor::instance* input )
 {
 	cbor::array_t detections = {};
+	cbor::object_t timings = {};
+	auto sel = detection::selection::parse( input );
+	timing::stopwatch total = {};
 
 	// Find the patchguard context.
 	//
+	timing::stopwatch sw = {};
 	auto* nt_base = *( win::image_x64_t** ) &ps::ntos_image_base;
 	auto* nt_hdrs = nt_base->get_nt_headers();
 	void** pg_context = nullptr;
@@ -50,56 +71,126 @@ extern "C" [[gnu::dllexport]] transport::packet* envValidate()
 	//
 	if ( pg_context && !*pg_context )
 		detections.emplace_back( cbor::object_t{ { "flag", "pg.noPgBoot" } } );
+	timing::record( timings, "patchguard", sw.elapsed() );
 
-	// Verify the code integrity of every driver.
+	// Verify the code integrity of every driver on the worker pool, largest images first, stopping early if the
+	// budget is exhausted.
 	//
+	sw = {};
+	uint64_t images_budget = sel.budget_of( "images" );
+	std::atomic<bool> images_truncated = false;
+	std::vector<ldr::km::data_table_entry_t*> images;
 	for ( ldr::km::data_table_entry_t* img : ntpp::module_list{} )
+		images.emplace_back( img );
+	std::vector<uint32_t> order( images.size() );
+	std::iota( order.begin(), order.end(), 0 );
+	std::stable_sort( order.begin(), order.end(), [ & ] ( uint32_t a, uint32_t b ) { return images[ a ]->size_of_image > images[ b ]->size_of_image; } );
+	std::vector<uint32_t> session_order;
+	std::erase_if( order, [ & ] ( uint32_t i )
 	{
-		// Read the image.
+		if ( !mm::is_session_address( images[ i ]->dll_base ) )
+			return false;
+		session_order.emplace_back( i );
+		return true;
+	} );
+	std::vector<uint8_t> patched( images.size() );
+	std::atomic<size_t> cache_hits = 0, cache_misses = 0;
+	std::vector<std::vector<uint8_t>> buffers( ke::query_active_processor_count( nullptr ) );
+
+	auto verify = [ & ] ( size_t index, size_t worker )
+	{
+		if ( images_budget && sw.elapsed() > images_budget )
+		{
+			images_truncated = true;
+			return;
+		}
+
+		// Locate the file.
 		//
-		std::wstring_view full_path{ img->full_dll_name };
-		auto data = ntpp::read_file( full_path );
-		if ( !data )
+		auto* img = images[ index ];
+		auto* mem_img = ( const win::image_x64_t* ) img->dll_base;
+		std::wstring path{ std::wstring_view{ img->full_dll_name } };
+		auto last_write = image_stream::query_last_write( path );
+		if ( !last_write )
 		{
 			// If this is a dump driver, try finding the real entry.
 			//
-			if ( size_t n = full_path.find( L"\\dump_" ); n != std::string::npos )
+			if ( size_t n = path.find( L"\\dump_" ); n != std::string::npos )
 			{
-				std::wstring new_path{ full_path };
-				new_path.erase( n + xstd::strlen( L"\\dump" ), 1 );
-				if ( data = ntpp::read_file( new_path ); !data )
+				path.erase( n + xstd::strlen( L"\\dump" ), 1 );
+				if ( last_write = image_stream::query_last_write( path ); !last_write )
 				{
-					new_path.erase( n + 1, xstd::strlen( L"dump" ) );
-					data = ntpp::read_file( new_path );
+					path.erase( n + 1, xstd::strlen( L"dump" ) );
+					last_write = image_stream::query_last_write( path );
 				}
 			}
 		}
 
-		// If we could read it:
+		// Reuse the verdict if neither the file nor the image changed since it was verified.
 		//
-		if ( data )
+		auto id = integrity::key::of( img, last_write.value_or( 0 ) );
+		integrity::relocations relocs = {};
+		if ( last_write )
 		{
-			// Skip if the checksum does not match.
-			//
-			auto* mem_img = ( const win::image_x64_t* ) img->dll_base;
-			auto* fs_img = ( const win::image_x64_t* ) data->data();
-			if ( mem_img->get_nt_headers()->optional_header.checksum != fs_img->get_nt_headers()->optional_header.checksum )
-				continue;
-
-			// If image hash does not match, add as a detection.
-			//
-			if ( !ntpp::ci::compare( mem_img, fs_img ) )
+			if ( auto verdict = integrity::cache::lookup( id, mem_img, relocs ) )
 			{
-				detections.emplace_back( cbor::object_t {
-					{ "flag",      xstd::fmt::str( "img.patch.%s", img->base_dll_name ) },
-					{ "imageBase", ( uint64_t ) img->dll_base                              },
-				} );
+				++cache_hits;
+				patched[ index ] = *verdict;
+				return;
 			}
 		}
+		++cache_misses;
+
+		// Stream the file and compare it against the image, checksum and layout mismatches are skipped.
+		//
+		auto& buffer = buffers[ worker ];
+		if ( buffer.empty() )
+			buffer.resize( image_stream::chunk_size );
+		auto verdict = image_stream::verify( path, mem_img, buffer, relocs );
+		if ( !verdict.read || !verdict.layout_match )
+			return;
+		patched[ index ] = verdict.patched;
+
+		// Save the verdict.
+		//
+		if ( last_write )
+		{
+			integrity::cache::store( {
+				.id = std::move( id ),
+				.patched = verdict.patched,
+				.file = std::move( verdict.file ),
+				.memory = std::move( verdict.memory ),
+				.relocs = std::move( verdict.relocs ),
+			} );
+		}
+	};
+	auto pool = worker_pool::run( order, sel.max_workers, verify );
+	for ( uint32_t index : session_order )
+		verify( index, 0 );
+
+	// Add the detections in load order.
+	//
+	for ( size_t i = 0; i != images.size(); i++ )
+	{
+		if ( patched[ i ] )
+		{
+			detections.emplace_back( cbor::object_t {
+				{ "flag",      xstd::fmt::str( "img.patch.%s", images[ i ]->base_dll_name ) },
+				{ "imageBase", ( uint64_t ) images[ i ]->dll_base                              },
+			} );
+		}
 	}
 
+	auto& images_timing = timing::record( timings, "images", sw.elapsed(), images_budget, images_truncated.load() );
+	images_timing[ "workers" ] = pool.workers;
+	images_timing[ "steals" ] = pool.steals;
+	images_timing[ "sessionImages" ] = session_order.size();
+	images_timing[ "cacheHits" ] = cache_hits.load();
+	images_timing[ "cacheMisses" ] = cache_misses.load();
+
 	// Verify the code integrity of every driver dispatch table.
 	//
+	sw = {};
 	uint16_t pxi_k = ia32::mem::px_index( ( void* ) &ps::ntos_image_base );
 	uint16_t pxi_s = ia32::mem::px_index( ( void* ) &kuser::get_parent );
 	ntpp::query_object_directory( L"\\Driver", [ & ] ( win::object_directory_information_t* info )
@@ -120,8 +211,11 @@ extern "C" [[gnu::dllexport]] transport::packet* envValidate()
 		}
 	} );
 
+	timing::record( timings, "dispatch", sw.elapsed() );
+
 	// Verify the integrity of HAL dispatch tables.
 	//
+	sw = {};
 	for ( auto [tbl, size] : { std::make_pair( ( void** ) &hal::dispatch_table,         0xa8 ),
                               std::make_pair( ( void** ) &hal::private_dispatch_table, 0x300 ) } )
 	{
@@ -151,11 +245,28 @@ extern "C" [[gnu::dllexport]] transport::packet* envValidate()
 		}
 	}
 
+	timing::record( timings, "hal", sw.elapsed() );
+	timing::record( timings, "total", total.elapsed() );
+	{
+		std::lock_guard _g{ last_timings_lock };
+		last_timings = std::move( timings );
+	}
+
 	// Return the serialized result.
 	//
 	return transport::serialize( std::move( detections ) );
 }
 
+// Exports the timings of the last envValidate call.
+//
+extern "C" [[gnu::dllexport]] transport::packet* envTiming()
+{
+	cbor::instance result = {};
+	std::lock_guard _g{ last_timings_lock };
+	result[ "timing" ] = last_timings;
+	return transport::serialize( result );
+}
+
 // Takes a list of image bases for the drivers we'd like to unload and returns the list of each driver we've failed to unload.
 //
 extern "C" [[gnu::dllexport]] transport::packet* envUnloadDriver( cbor::instance * input )
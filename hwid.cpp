@@ -14,6 +14,7 @@
 #include <sdk/win/key_basic_information_t.hpp>
 #include <sdk/nt/functional_device_extension_t.hpp>
 #include <bus/stor.hpp>
+#include "timing.hpp"
 
 struct stor_scsi_address_t
 {
@@ -211,9 +212,11 @@ extern "C" [[gnu::dllexport, virtualize]] transport::packet* hwidCollectNet()
 	cbor::instance result = {};
 	auto& data = result[ "data" ].object();
 	auto& net = data[ "net" ].object();
+	auto& timings = result[ "timing" ].object();
 
 	// Query all neighbors.
 	//
+	timing::stopwatch sw = {};
 	if ( auto ipnet = netio::mib_ipnet_t::query( AF_INET ) )
 	{
 		auto& neighbors = net[ "neighbours" ].array();
@@ -247,6 +250,7 @@ extern "C" [[gnu::dllexport, virtualize]] transport::packet* hwidCollectNet()
 			neighbors.emplace_back( std::move( obj ) );
 		}
 	}
+	timing::record( timings, "neighbours", sw.elapsed() );
 	return transport::serialize( result );
 }
 
@@ -257,9 +261,11 @@ extern "C" [[gnu::dllexport, virtualize]] transport::packet* hwidCollectUefi()
 	cbor::instance result = {};
 	auto& data = result[ "data" ].object();
 	auto& errors = result[ "errors" ].object();
+	auto& timings = result[ "timing" ].object();
 
 	// If UEFI firmware:
 	//
+	timing::stopwatch sw = {};
 	if ( ex::get_firmware_type() == nt::firmware_type_t::uefi )
 	{
 		auto& uefi = data[ "uefi" ].object();
@@ -298,6 +304,7 @@ extern "C" [[gnu::dllexport, virtualize]] transport::packet* hwidCollectUefi()
 			errors[ "uefiError" ] = values.status.to_string();
 		}
 	}
+	timing::record( timings, "variables", sw.elapsed() );
 
 	return transport::serialize( result );
 }
@@ -310,14 +317,18 @@ extern "C" [[gnu::dllexport, virtualize]] transport::packet* hwidCollectCpuBios(
 	auto& data = result[ "data" ].object();
 	auto& errors = result[ "errors" ].object();
 	auto& flags = result[ "flags" ].array();
+	auto& timings = result[ "timing" ].object();
 
 	// Get the CPU details.
 	//
+	timing::stopwatch sw = {};
 	data[ "cpuBrand" ] = ia32::get_brand();
 	data[ "cpuHash" ] =  xstd::make_hash<xstd::fnv64>( ia32::static_cpuid<0x1, 0>[ 0 ], ia32::static_cpuid<0x0, 0>[ 0 ] ).as64();
+	timing::record( timings, "cpu", sw.elapsed() );
 
 	// Get the BIOS identifiers.
 	//
+	sw = {};
 	if ( auto bios_id = hwid::get_bios_identifiers() )
 	{
 		auto& bios = data[ "bios" ];
@@ -350,6 +361,7 @@ extern "C" [[gnu::dllexport, virtualize]] transport::packet* hwidCollectCpuBios(
 	{
 		errors[ "biosError" ] = bios_id.status;
 	}
+	timing::record( timings, "bios", sw.elapsed() );
 
 	return transport::serialize( result );
 }
@@ -361,9 +373,11 @@ extern "C" [[gnu::dllexport, virtualize]] transport::packet* hwidCollectPci()
 	cbor::instance result = {};
 	auto& data = result[ "data" ].object();
 	auto& flags = result[ "flags" ].array();
+	auto& timings = result[ "timing" ].object();
 
 	// Get all PCI devices.
 	//
+	timing::stopwatch sw = {};
 	auto& pci_devices = ia32::pci::get_device_list();
 	if ( !pci_devices.empty() )
 	{
@@ -396,6 +410,7 @@ extern "C" [[gnu::dllexport, virtualize]] transport::packet* hwidCollectPci()
 		if ( is_vm )    flags.push_back( "vm.vmwarePci" );
 		if ( !has_gpu ) flags.push_back( "vm.pciNoGpu" );
 	}
+	timing::record( timings, "pci", sw.elapsed() );
 
 	return transport::serialize( result );
 }
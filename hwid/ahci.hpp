@@ -7,20 +7,112 @@
 #include <ia32/memory.hpp>
 #include <bus/stor.hpp>
 #include "disk_id.hpp"
-#include "../upause.hpp"
 
 namespace ahci
 {
-	struct identify_request
+	struct identify_buffer
 	{
 		hba_command_table   table;
 		ata::identification  identity;
 	};
 
-	// Identifies all devices under the given AHCI controller.
+	// Identification of the device behind a single port, split into phases so that several ports can be driven at once.
+	//
+	struct identify_request
+	{
+		const ia32::pci::device* device = nullptr;
+		decltype( ia32::mem::map_physical<volatile hba_registers>( 0 ) ) hba = {};
+		decltype( ia32::mem::map_physical<hba_command_list>( 0 ) ) cmd_list = {};
+		decltype( &hba->ports[ 0 ] ) port = nullptr;
+		identify_buffer* id = nullptr;
+		uint32_t slot_mask = 0;
+		uint32_t slot_flag = 0;
+		uint64_t issued_at = 0; // TSC of the command issue write.
+		bool complete = false;
+
+		// Takes a free command slot, writes the command into it and issues it.
+		// - The slot is picked right before it is issued to keep the window in which storport may take it as well short.
+		// - Returns false if every implemented slot is busy.
+		//
+		bool issue()
+		{
+			bitcnt_t slot = xstd::lsb( slot_mask & ~( port->sata_active | port->command_issue ) );
+			if ( slot == -1 )
+				return false;
+			slot_flag = 1u << slot;
+
+			// Reset the ID space.
+			//
+			memset( id, 0, sizeof( identify_buffer ) );
+
+			// Ready the command slot.
+			//
+			auto* cmd = &cmd_list->commands[ slot ];
+			memset( cmd, 0, sizeof( hba_command_header ) );
+			cmd->command_table_base = ia32::mem::get_physical_address( &id->table );
+			cmd->fis_length = sizeof( fis_h2d ) / 4;
+			cmd->write = false;
+			cmd->len_prdt = 1;
+
+			// Write the FIS.
+			//
+			auto* fis = ( fis_h2d* ) &id->table.fis;
+			fis->type = fis_type::reg_h2d;
+			fis->c = true;
+			fis->command = ata::identification::opcode;
+
+			// Write the PRDT describing the output.
+			//
+			auto prdt = &id->table.prdt[ 0 ];
+			prdt->data_base = ia32::mem::get_physical_address( &id->identity );
+			prdt->length = sizeof( ata::identification ) - 1;
+			prdt->interrupt = false;
+			ia32::sfence();
+
+			// Issue the command.
+			//
+			port->command_issue |= slot_flag;
+			issued_at = ia32::read_tsc();
+			return true;
+		}
+
+		// Checks whether or not the command completed.
+		//
+		bool poll() const { return ( port->command_issue & slot_flag ) == 0; }
+
+		// Saves the identification, or cancels the command if it timed out.
+		//
+		void finish( hwid::disk_set& result )
+		{
+			if ( !slot_flag )
+				return;
+			complete = poll();
+			if ( !complete )
+			{
+				port->command_issue &= ~slot_flag;
+				return;
+			}
+
+			hwid::disk_identifier entry = { 
+				device->config.vendor_id,
+				device->config.device_id,
+				device->subsystem,
+				device->config.revision_id,
+				( uint8_t ) device->address.function,
+				( uint8_t ) device->address.bus,
+				( uint8_t ) device->address.device,
+				id->identity.model_number.to_string(), 
+				id->identity.serial_number.to_string() 
+			};
+			if ( !entry.model.empty() && !entry.serial.empty() )
+				result.insert( std::move( entry ) );
+		}
+	};
+
+	// Prepares the identification of all devices under the given AHCI controller, pages are taken from the given index.
 	// - Return value indicates whether or not the operation should be retried.
 	//
-	[[no_obfuscate]] inline bool identify( hwid::disk_set& result, const ia32::pci::device& device )
+	[[no_obfuscate]] inline bool prepare( std::vector<identify_request>& requests, const ia32::pci::device& device, size_t& page_index )
 	{
 		// Get the ABAR.
 		//
@@ -46,6 +138,11 @@ namespace ahci
 		if ( !( hba->caps.global_host_control >> 31 ) || !( hba->caps.host_capabilities >> 31 ) )
 			return true;
 
+		// Limit the slots to the implemented ones.
+		//
+		uint32_t slot_count = ( ( hba->caps.host_capabilities >> 8 ) & 0x1F ) + 1;
+		uint32_t slot_mask = slot_count == 32 ? ~0u : ( ( 1u << slot_count ) - 1 );
+
 		// Enumerate implemented ports:
 		//
 		bool fail = false;
@@ -62,15 +159,6 @@ namespace ahci
 			uint64_t command_list = port->command_list_lo;
 			command_list |= uint64_t( port->command_list_hi ) << 32;
 
-			// Find an empty slot.
-			//
-			bitcnt_t slot = xstd::lsb( ~( port->sata_active | port->command_issue ) );
-			if ( slot == -1 )
-			{
-				fail = true;
-				return;
-			}
-
 			// Validate and map the command list.
 			//
 			if ( !command_list || !xstd::is_aligned( command_list, alignof( hba_command_list ) ) )
@@ -85,64 +173,28 @@ namespace ahci
 				return;
 			}
 
-			// Reset the ID space.
-			//
-			auto* id = ( identify_request* ) hwid::identification_space;
-			memset( id, 0, sizeof( identify_request ) );
-
-			// Ready the first command slot.
-			//
-			auto* cmd = &cmd_list->commands[ 0 ];
-			memset( cmd, 0, sizeof( hba_command_header ) );
-			cmd->command_table_base = ia32::mem::get_physical_address( &id->table );
-			cmd->fis_length = sizeof( fis_h2d ) / 4;
-			cmd->write = false;
-			cmd->len_prdt = 1;
-
-			// Write the FIS.
-			//
-			auto* fis = ( fis_h2d* ) &id->table.fis;
-			fis->type = fis_type::reg_h2d;
-			fis->c = true;
-			fis->command = ata::identification::opcode;
-
-			// Write the PRDT describing the output.
-			//
-			auto prdt = &id->table.prdt[ 0 ];
-			prdt->data_base = ia32::mem::get_physical_address( &id->identity );
-			prdt->length = sizeof( ata::identification ) - 1;
-			prdt->interrupt = false;
-			ia32::sfence();
-
-			// Issue the command and wait for 100ms.
-			//
-			const uint32_t slot_flag = 1u << slot;
-			port->command_issue |= slot_flag;
-
-			// Fail if it timed out.
+			// Take an identification page for the port.
 			//
-			if ( !util::upause( 100ms, [ & ] () { return ( port->command_issue & slot_flag ) == 0; } ) )
+			auto* id = ( identify_buffer* ) hwid::identification_page( page_index );
+			if ( !id )
 			{
-				port->command_issue &= ~slot_flag;
+				fail = true;
 				return;
 			}
+			page_index++;
 
-			// Save the identification.
-			//
-			hwid::disk_identifier entry = { 
-				device.config.vendor_id,
-				device.config.device_id,
-				device.subsystem,
-				device.config.revision_id,
-				( uint8_t ) device.address.function,
-				( uint8_t ) device.address.bus,
-				( uint8_t ) device.address.device,
-				id->identity.model_number.to_string(), 
-				id->identity.serial_number.to_string() 
-			};
-			if ( !entry.model.empty() && !entry.serial.empty() )
-				result.insert( std::move( entry ) );
+			auto& req = requests.emplace_back();
+			req.device = &device;
+			req.cmd_list = std::move( cmd_list );
+			req.port = port;
+			req.id = id;
+			req.slot_mask = slot_mask;
 		} );
+
+		// Keep the registers mapped with the last request of the controller.
+		//
+		if ( !requests.empty() && requests.back().device == &device )
+			requests.back().hba = std::move( hba );
 		return fail;
 	}
-};
+};
\ No newline at end of file
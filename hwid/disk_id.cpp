@@ -7,6 +7,7 @@
 #include <sdk/ke/api.hpp>
 #include "ahci.hpp"
 #include "nvme.hpp"
+#include "../upause.hpp"
 
 // Forces physical disks out of D3 sleep by issuing dummy I/O commands.
 //
@@ -54,6 +55,90 @@ static void force_out_of_d3()
 	}
 }
 
+// Identifies every NVMe and AHCI device concurrently, issuing all commands before waiting so that the total wait is
+// that of the slowest device rather than the sum.
+// - Return value indicates whether or not the operation should be retried.
+//
+template<typename L>
+static bool identify_all( hwid::disk_set& identifiers, const L& nvme_devices, const L& ahci_devices )
+{
+	bool retry = false;
+
+	// Map every controller, each request takes its own identification page.
+	//
+	size_t page_index = 0;
+	std::vector<nvme::identify_request> nvme_requests;
+	nvme_requests.reserve( std::size( nvme_devices ) );
+	for ( auto& device : nvme_devices )
+	{
+		auto& req = nvme_requests.emplace_back();
+		if ( auto r = req.prepare( device, hwid::identification_page( page_index++ ) ) )
+		{
+			retry |= *r;
+			nvme_requests.pop_back();
+		}
+	}
+	std::vector<ahci::identify_request> ahci_requests;
+	for ( auto& device : ahci_devices )
+		retry |= ahci::prepare( ahci_requests, device, page_index );
+
+	// Issue all commands with interrupts disabled and wait for all of them at once.
+	//
+	ia32::disable();
+	std::vector<util::wait_condition> waits;
+	for ( auto& req : nvme_requests )
+	{
+		req.issue();
+		waits.push_back( util::wait_on<&nvme::identify_request::poll>( req, 100ms, req.completion_line(), nullptr, req.issued_at ) );
+	}
+	for ( auto& req : ahci_requests )
+	{
+		if ( req.issue() )
+			waits.push_back( util::wait_on<&ahci::identify_request::poll>( req, 100ms, nullptr, nullptr, req.issued_at ) );
+		else
+			retry = true;
+	}
+	util::wait_all( waits );
+
+	// Acknowledge the NVMe commands, retry the ones that did not respond once.
+	//
+	waits.clear();
+	std::vector<nvme::identify_request*> nvme_retry;
+	for ( auto& req : nvme_requests )
+	{
+		if ( req.acknowledge() )
+		{
+			req.reissue();
+			waits.push_back( util::wait_on<&nvme::identify_request::poll>( req, 100ms, req.completion_line(), nullptr, req.issued_at ) );
+			nvme_retry.push_back( &req );
+		}
+	}
+	util::wait_all( waits );
+	for ( auto* req : nvme_retry )
+		req->acknowledge();
+
+	// Restore the NVMe queues, sleeping until the buffers wrap.
+	//
+	waits.clear();
+	for ( auto& req : nvme_requests )
+	{
+		req.restore_begin();
+		waits.push_back( util::wait_on<&nvme::identify_request::wrapped>( req, 100ms, req.wrce, nullptr, req.issued_at ) );
+	}
+	util::wait_all( waits );
+	for ( auto& req : nvme_requests )
+		req.restore_end();
+
+	// Enable interrupts again and interprete the results.
+	//
+	ia32::enable();
+	for ( auto& req : nvme_requests )
+		retry |= req.finish( identifiers );
+	for ( auto& req : ahci_requests )
+		req.finish( identifiers );
+	return retry;
+}
+
 // Issues identify commands to every supported disk controller in the device and returns the resulting identifiers.
 //
 NO_INLINE hwid::disk_set hwid::get_disks()
@@ -90,32 +175,22 @@ NO_INLINE hwid::disk_set hwid::get_disks()
 	if ( in_sleep )
 		force_out_of_d3();
 
+	// Reserve an identification page per NVMe controller ahead of time, AHCI ports take the following ones.
+	//
+	hwid::identification_page( nvme_devices.size() );
+
 	// Attempt to grab identifiers up to four times.
 	//
 	bool retry = false;
 	for ( size_t n = 0; n != 4; n++ )
 	{
-		// Identify NVMe drives.
+		// Identify all drives at once.
 		//
-		for ( auto& device : nvme_devices )
+		ntpp::call_dpc( [ & ] ()
 		{
-			ntpp::call_dpc( [ & ] ()
-			{
-				if ( nt::read_pcid() == 0 )
-					retry |= nvme::identify( identifiers, device );
-			} );
-		}
-	
-		// Identify AHCI drives.
-		//
-		for ( auto& device : ahci_devices )
-		{
-			ntpp::call_dpc( [ & ] ()
-			{
-				if ( nt::read_pcid() == 0 )
-					retry |= ahci::identify( identifiers, device );
-			} );
-		}
+			if ( nt::read_pcid() == 0 )
+				retry |= identify_all( identifiers, nvme_devices, ahci_devices );
+		} );
 	
 		// If we're done, break out.
 		//
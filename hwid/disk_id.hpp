@@ -1,5 +1,6 @@
 #pragma once
 #include <xstd/hashable.hpp>
+#include <vector>
 #include <unordered_set>
 #include <sdk/mi/api.hpp>
 #include <sdk/nt/mmpfn_t.hpp>
@@ -39,16 +40,41 @@ namespace hwid
 		bool operator!=( const disk_identifier& o ) const { return model != o.model || serial != o.serial; }
 	};
 
-	// Page in the low 4GB range used for identification data.
+	// Allocates a page in the low 4GB range for identification data, preferring lower addresses.
 	//
-	inline auto identification_space = [ ] ()
+	inline uint8_t* allocate_identification_page()
 	{
 		for ( auto lim : { 2_gb, 3_gb, 4_gb, UINT64_MAX } )
 			if ( void* res = mm::allocate_contiguous_memory( 0x1000, lim ) )
 				return ( uint8_t* ) res;
+		return nullptr;
+	}
+
+	// Page used for identification data.
+	//
+	inline auto identification_space = [ ] ()
+	{
+		if ( auto* res = allocate_identification_page() )
+			return res;
 		unreachable();
 	}();
 
+	// Pages used for identification data by concurrent requests, allocated on demand and kept for the next calls.
+	// - Index 0 is the identification space.
+	//
+	inline std::vector<uint8_t*> identification_pages = { identification_space };
+	inline uint8_t* identification_page( size_t index )
+	{
+		while ( identification_pages.size() <= index )
+		{
+			auto* page = allocate_identification_page();
+			if ( !page )
+				return nullptr;
+			identification_pages.push_back( page );
+		}
+		return identification_pages[ index ];
+	}
+
 
 	// Describes a set of disks.
 	//
@@ -11,6 +11,11 @@
 #include <ntpp.hpp>
 #include <vmx.hpp>
 #include "benchmark.hpp"
+#include "detection.hpp"
+#include "scheduler.hpp"
+#include "classifier.hpp"
+#include "pt_transaction.hpp"
+#include "timing.hpp"
 #include "interrupt_guard.hpp"
 
 // Northbridge tests.
@@ -119,35 +124,39 @@ namespace processor
 			{ IA32_PPERF,  benchmark::has_pperf },
 			{ IA32_IRPERF, benchmark::has_irperf }
 		};
-		for ( auto&& [msr, out] : msr_list )
+		bool null_clock = false;
 		{
 			interrupt_counters ctrs = {};
-			interrupt_guard g{ &ctrs };
-			auto val = ia32::read_msr( msr );
-			if ( ctrs.has_exception() )
-			{
-				out = 0;
-			}
-			else if ( !val )
-			{
-				g.end();
-				detections[ "vm.nullClock" ] = true;
-				out = 0;
-			}
-			else
+			interrupt_session session{};
+			for ( auto&& [msr, out] : msr_list )
 			{
-				ia32::read_msr( msr | 0xC0000000 );
-				out = ctrs.has_exception() ? 1 : 2;
+				ctrs.clear();
+				session.bind( &ctrs );
+				auto val = probe::read_msr( msr );
+				if ( ctrs.has_exception() )
+				{
+					out = 0;
+				}
+				else if ( !val )
+				{
+					null_clock = true;
+					out = 0;
+				}
+				else
+				{
+					probe::read_msr( msr | 0xC0000000 );
+					out = ctrs.has_exception() ? 1 : 2;
+				}
 			}
 		}
+		if ( null_clock )
+			detections[ "vm.nullClock" ] = true;
 	}
 
-	// Test if the guest interruptability is faultily implemented.
+	// Test if STR and SLDT are faultily emulated.
 	//
-	FORCE_INLINE static void test_int( cbor::object_t& result, cbor::object_t& detections )
+	FORCE_INLINE static void test_str( cbor::object_t& result, cbor::object_t& detections )
 	{
-		// Test STR and SLDT.
-		//
 		{
 			uint64_t b = 0;
 			uint64_t a = -1;
@@ -174,7 +183,12 @@ namespace processor
 			b |= ( ( a >> 16 ) - 0xeacceacceacc );
 			detections[ "vm.sldtEmulFail" ] = b != 0;
 		}
+	}
 
+	// Test if the guest interruptability is faultily implemented.
+	//
+	FORCE_INLINE static void test_int( cbor::object_t& result, cbor::object_t& detections )
+	{
 		// Cause a suppressed #DB and count the interrupts.
 		//
 		static uint16_t g = 0x18;
@@ -296,7 +310,7 @@ namespace processor
 
 	// Tests if control registers are faultily implemented.
 	//
-	FORCE_INLINE static void test_cr( cbor::object_t&, cbor::object_t& detections )
+	FORCE_INLINE static void test_cr( cbor::object_t& result, cbor::object_t& detections )
 	{
 		auto xcr0 =   ia32::read_xcr( 0 );
 		auto randhi = ( ia32::read_tsc() << 32 ) | ( 1ull << 32 );
@@ -308,12 +322,12 @@ namespace processor
 			// Try reading ECX=1.
 			//
 			interrupt_guard g{ &ctrs };
-			ia32::read_xcr( 1 | randhi );
+			probe::read_xcr( 1 | randhi );
 		} else {
 			// Try reading ECX=0.
 			//
 			interrupt_guard g{ &ctrs };
-			ia32::read_xcr( 0 | randhi );
+			probe::read_xcr( 0 | randhi );
 		}
 		detections[ "vm.xgetbvEmulFail" ] = ctrs.has_exception();
 		ctrs.clear();
@@ -322,7 +336,7 @@ namespace processor
 		//
 		{
 			interrupt_guard g{ &ctrs };
-			ia32::write_xcr( 3, 0 );
+			probe::write_xcr( 3, 0 );
 		}
 		detections[ "vm.xsetbvLeafEmulFail" ] = !ctrs.has_exception();
 		ctrs.clear();
@@ -331,7 +345,7 @@ namespace processor
 		//
 		{
 			interrupt_guard g{ &ctrs };
-			ia32::write_xcr( randhi, xcr0 );
+			probe::write_xcr( randhi, xcr0 );
 		}
 		detections[ "vm.xsetbvLeafEmulFail2" ] = ctrs.has_exception();
 		ctrs.clear();
@@ -340,7 +354,7 @@ namespace processor
 		//
 		{
 			interrupt_guard g{ &ctrs };
-			ia32::write_xcr( randhi, xcr0 | ( 1ull << 21 ) /*the XAAD bit*/ );
+			probe::write_xcr( randhi, xcr0 | ( 1ull << 21 ) /*the XAAD bit*/ );
 		}
 		detections[ "vm.xsetbvValueEmulFail" ] = !ctrs.has_exception();
 		ctrs.clear();
@@ -348,6 +362,191 @@ namespace processor
 		// Flag if SMSW does not match CR0.
 		//
 		detections[ "vm.smswEmulFail" ] = uint32_t( ia32::smsw().flags ^ ia32::read_cr0().flags ) != 0;
+		result[ "lengthCache" ] = cbor::object_t{
+			{ "hits",   ctrs.length_hits },
+			{ "misses", ctrs.length_misses },
+		};
+	}
+
+	// XSAVE area shared by the state-size test and the benchmarks, followed by a guard region.
+	//
+	static constexpr size_t xsave_area_capacity = 0x4000;
+	static constexpr size_t xsave_area_guard =    0x100;
+	alignas( 64 ) static uint8_t xsave_area[ xsave_area_capacity + xsave_area_guard ];
+	static uint64_t xsave_rfbm = 0;
+
+	// XSAVE instruction variants.
+	//
+	enum class xsave_variant : uint8_t
+	{
+		xsave,
+		xsaveopt,
+		xsavec,
+		xsaves,
+	};
+	// Checks whether or not the variant can be executed, XSAVE itself requires CR4.OSXSAVE and leaf 0xD to enumerate the state.
+	//
+	FORCE_INLINE static bool xsave_supported( xsave_variant v )
+	{
+		if ( !ia32::static_cpuid_s<1, 0, ia32::cpuid_eax_01>.cpuid_feature_information_ecx.osx_save )
+			return false;
+		if ( ia32::static_cpuid<0, 0, ia32::cpuid_eax_00>.max_cpuid_input_value < 0xD )
+			return false;
+		uint32_t eax = ia32::static_cpuid<0xD, 1>[ 0 ];
+		switch ( v )
+		{
+			case xsave_variant::xsaveopt: return eax & ( 1 << 0 );
+			case xsave_variant::xsavec:   return eax & ( 1 << 1 );
+			case xsave_variant::xsaves:   return eax & ( 1 << 3 );
+			default:                      return true;
+		}
+	}
+	template<xsave_variant V>
+	FORCE_INLINE static void xsave_to( void* area, uint64_t rfbm )
+	{
+		uint32_t lo = uint32_t( rfbm );
+		uint32_t hi = uint32_t( rfbm >> 32 );
+		if constexpr ( V == xsave_variant::xsave )
+			asm volatile( "xsave64 (%0)" :: "r" ( area ), "a" ( lo ), "d" ( hi ) : "memory" );
+		else if constexpr ( V == xsave_variant::xsaveopt )
+			asm volatile( "xsaveopt64 (%0)" :: "r" ( area ), "a" ( lo ), "d" ( hi ) : "memory" );
+		else if constexpr ( V == xsave_variant::xsavec )
+			asm volatile( "xsavec64 (%0)" :: "r" ( area ), "a" ( lo ), "d" ( hi ) : "memory" );
+		else
+			asm volatile( "xsaves64 (%0)" :: "r" ( area ), "a" ( lo ), "d" ( hi ) : "memory" );
+	}
+
+	// Computes the standard and compacted XSAVE area sizes for the given feature mask from the CPUID leaf 0xD sub-leaves.
+	//
+	static std::pair<uint32_t, uint32_t> xsave_layout( uint64_t rfbm )
+	{
+		uint32_t standard = 512 + 64;
+		uint32_t compacted = 512 + 64;
+		for ( uint32_t i = 2; i != 63; i++ )
+		{
+			if ( !xstd::bit_test( rfbm, i ) )
+				continue;
+			auto [size, offset, flags, _] = ia32::query_cpuid( 0xD, i );
+			if ( !size )
+				continue;
+
+			// Supervisor components have no place in the standard form.
+			//
+			if ( !( flags & 1 ) )
+				standard = std::max( standard, offset + size );
+			if ( flags & 2 )
+				compacted = xstd::align_up( compacted, 64 );
+			compacted += size;
+		}
+		return { standard, compacted };
+	}
+
+	// Returns the number of bytes an XSAVE variant writes into the guarded area, or std::nullopt if it faults.
+	//
+	template<xsave_variant V>
+	static std::optional<size_t> xsave_extent( uint64_t rfbm, size_t limit )
+	{
+		size_t extent = 0;
+		for ( uint8_t fill : { 0xCC, 0x33 } )
+		{
+			memset( xsave_area, fill, limit );
+
+			interrupt_counters ctrs = {};
+			{
+				interrupt_guard _g{ &ctrs };
+				xsave_to<V>( xsave_area, rfbm );
+			}
+			if ( ctrs.has_exception() )
+				return std::nullopt;
+
+			size_t n = limit;
+			while ( n && xsave_area[ n - 1 ] == fill )
+				--n;
+			extent = std::max( extent, n );
+		}
+		return extent;
+	}
+
+	// Test if the XSAVE state sizes reported by CPUID match what the processor actually writes.
+	//
+	FORCE_INLINE static void test_xsave( cbor::object_t& result, cbor::object_t& detections )
+	{
+		if ( !xsave_supported( xsave_variant::xsave ) )
+			return;
+
+		// IA32_XSS only exists with XSAVES, read it guarded since a hypervisor may advertise one without the other.
+		//
+		auto xcr0 = ia32::read_xcr( 0 );
+		uint64_t xss = 0;
+		bool with_xsaves = xsave_supported( xsave_variant::xsaves );
+		bool xss_faulted = false;
+		if ( with_xsaves )
+		{
+			interrupt_counters ctrs = {};
+			{
+				interrupt_guard _g{ &ctrs };
+				xss = probe::read_msr( IA32_XSS );
+			}
+			if ( ctrs.has_exception() )
+			{
+				xss = 0;
+				with_xsaves = false;
+				xss_faulted = true;
+				detections[ "vm.xsaveFaulted" ] = true;
+			}
+		}
+
+		// Flag if the size reported for the enabled features does not match the component layout.
+		//
+		uint32_t size_enabled = ia32::query_cpuid( 0xD, 0 )[ 1 ];
+		uint32_t size_max = ia32::query_cpuid( 0xD, 0 )[ 2 ];
+		uint32_t size_supervisor = ia32::query_cpuid( 0xD, 1 )[ 1 ];
+		auto [standard, compacted] = xsave_layout( xcr0 );
+		uint32_t compacted_supervisor = xsave_layout( xcr0 | xss ).second;
+		detections[ "vm.xsaveSizeMismatch" ] = size_enabled != standard || size_enabled > size_max;
+		if ( with_xsaves )
+			detections[ "vm.xsavesSizeMismatch" ] = size_supervisor != compacted_supervisor;
+
+		auto& xsave_data = result[ "xsave" ].object();
+		xsave_data[ "xcr0" ] = xcr0;
+		xsave_data[ "xss" ] = xss;
+		xsave_data[ "reported" ] = size_enabled;
+		xsave_data[ "reportedMax" ] = size_max;
+		xsave_data[ "reportedSupervisor" ] = size_supervisor;
+		xsave_data[ "computed" ] = standard;
+		xsave_data[ "computedCompact" ] = compacted;
+
+		// Skip the write tests if the area would not fit our buffer.
+		//
+		if ( std::max<size_t>( { size_enabled, size_max, size_supervisor } ) > xsave_area_capacity )
+		{
+			xsave_data[ "areaTooLarge" ] = true;
+			return;
+		}
+
+		// Flag if any variant faults or writes past the size it should be limited to.
+		//
+		bool faulted = false;
+		bool overflow = false;
+		auto check = [ & ] ( const char* name, std::optional<size_t> extent, size_t expected )
+		{
+			if ( !extent )
+			{
+				faulted = true;
+				return;
+			}
+			xsave_data[ name ] = *extent;
+			overflow |= *extent > expected;
+		};
+		check( "xsaveWritten", xsave_extent<xsave_variant::xsave>( xcr0, size_enabled + xsave_area_guard ), size_enabled );
+		if ( xsave_supported( xsave_variant::xsaveopt ) )
+			check( "xsaveoptWritten", xsave_extent<xsave_variant::xsaveopt>( xcr0, size_enabled + xsave_area_guard ), size_enabled );
+		if ( xsave_supported( xsave_variant::xsavec ) )
+			check( "xsavecWritten", xsave_extent<xsave_variant::xsavec>( xcr0, compacted + xsave_area_guard ), compacted );
+		if ( with_xsaves )
+			check( "xsavesWritten", xsave_extent<xsave_variant::xsaves>( xcr0 | xss, size_supervisor + xsave_area_guard ), size_supervisor );
+		detections[ "vm.xsaveFaulted" ] = faulted || xss_faulted;
+		detections[ "vm.xsaveOverflow" ] = overflow;
 	}
 
 	// Test if processor identifiers are faultily implemented or indicate the presence of an hypervisor.
@@ -359,6 +558,15 @@ namespace processor
 		auto max_cpuid = ia32::static_cpuid<0, 0, ia32::cpuid_eax_00>.max_cpuid_input_value;
 		if ( max_cpuid >= 0xD )
 			detections[ "vm.cpuidEcxSuppressed" ] = ia32::static_cpuid<0xD, 0x00> == ia32::static_cpuid<0xD, 0x01>;
+
+		// Hash the leaves that should be identical across processors, masking the APIC ID.
+		//
+		auto l1 = ia32::query_cpuid( 1 );
+		l1[ 1 ] &= 0x00FFFFFF;
+		auto l7 = ia32::query_cpuid( 7 );
+		auto ld = max_cpuid >= 0xD ? ia32::query_cpuid( 0xD ) : decltype( l7 ){};
+		auto le = ia32::query_cpuid( 0x80000001 );
+		result[ "cpuidHash" ] = xstd::make_hash<xstd::fnv64>( ia32::query_cpuid( 0 ), l1, l7, ld, le ).as64();
 	}
 
 	// Test if debug extensions are faultily implemented or are being used on us.
@@ -489,7 +697,7 @@ namespace processor
 
 	// Test if MSRs are faultily implemented.
 	//
-	FORCE_INLINE static void test_msr( cbor::object_t&, cbor::object_t& detections )
+	FORCE_INLINE static void test_msr( cbor::object_t& result, cbor::object_t& detections )
 	{
 		// MSR reads do not #GP as expected.
 		//
@@ -497,100 +705,89 @@ namespace processor
 			detections[ "vm.msrDefaultInvalid" ] = benchmark::has_mperf == 2 && benchmark::has_irperf;
 
 		// Check for hypervisor MSRs.
+		// - Shares a single session with the next probe, which only rebinds the counters.
 		//
 		interrupt_counters ctrs = {};
+		interrupt_counters tsc_ctrs = {};
+		size_t fail_count = 0;
 		{
-			interrupt_guard _g{ &ctrs };
-			ia32::read_msr( 0x4b564d01 );
-			ia32::read_msr( 0x40000000 );
-		}
-		detections[ "vm.hvMsrs" ] = ctrs.count_exceptions() != 2;
+			interrupt_session session{ &ctrs };
+			probe::read_msr( 0x4b564d01 );
+			probe::read_msr( 0x40000000 );
 
-		// Check for emulation failure w.r.t RCX/ECX distinguishment.
-		// - Also functions as a check for the AMD SVM errata where 0x10 is not affected by TSC offsetting.
-		//
-		size_t fail_count = 0;
-		for ( size_t n = 0; n != 16; n++ ) {
-			ctrs.clear();
-			interrupt_guard g{ &ctrs };
-			uint64_t tsc1, tsc2;
-			__NoObfuscate(
-				ia32::serialize();
-				tsc1 = ia32::read_tsc();
-				ia32::serialize();
-				tsc2 = ia32::read_msr( 0x10 );
-				ia32::serialize();
-			);
-			g.end();
-			// Delta shouldn't be more than 1500 cycles.
-			fail_count += ( ctrs.has_exception() || ( uint64_t( tsc2 - tsc1 ) > 1500 ) ) ? 1 : 0;
+			// Check for emulation failure w.r.t RCX/ECX distinguishment.
+			// - Also functions as a check for the AMD SVM errata where 0x10 is not affected by TSC offsetting.
+			//
+			for ( size_t n = 0; n != 16; n++ ) {
+				tsc_ctrs.clear();
+				session.bind( &tsc_ctrs );
+				uint64_t tsc1, tsc2;
+				__NoObfuscate(
+					ia32::serialize();
+					tsc1 = ia32::read_tsc();
+					ia32::serialize();
+					tsc2 = probe::read_msr( 0x10 );
+					ia32::serialize();
+				);
+				// Delta shouldn't be more than 1500 cycles.
+				fail_count += ( tsc_ctrs.has_exception() || ( uint64_t( tsc2 - tsc1 ) > 1500 ) ) ? 1 : 0;
+			}
 		}
+		detections[ "vm.hvMsrs" ] = ctrs.count_exceptions() != 2;
 		detections[ "vm.tscMsrEmulFail" ] = fail_count > 8;
+		result[ "lengthCache" ] = cbor::object_t{
+			{ "hits",   ctrs.length_hits + tsc_ctrs.length_hits },
+			{ "misses", ctrs.length_misses + tsc_ctrs.length_misses },
+		};
+	}
+
+	// Upper bound of the page table entries staged by test_nx on the current processor: the test page, the IDT and the
+	// 256 handler pages, the GDT, the TSS, the code and the stack.
+	//
+	static size_t nx_entries()
+	{
+		auto [gdt, lim] = ia32::get_gdt();
+		auto* tss = ( ( ia32::tss_entry* ) &gdt[ ia32::get_tr().index ] );
+		size_t n = pt_transaction::entries_for( 0x1000, false );
+		n += pt_transaction::entries_for( 0x1000, true ) * ( 1 + 0x100 );
+		n += pt_transaction::entries_for( ( lim + 1 ) * sizeof( ia32::gdt_entry ), true );
+		n += pt_transaction::entries_for( tss->get_limit() + 1, true );
+		n += pt_transaction::entries_for( 0x2000, true ) * 2;
+		return n;
 	}
 
 	// Test if NX is handled properly.
 	//
-	[[no_split]] static void test_nx( volatile uint8_t* page, cbor::object_t&, cbor::object_t& detections )
+	[[no_split]] static void test_nx( volatile uint8_t* page, pt_transaction& paging, cbor::object_t& result, cbor::object_t& detections )
 	{
-		static std::pair<ia32::pt_entry_64*, bool> revert_list[ 4096 ];
-		static size_t revert_list_i = 0;
-		static constexpr auto set_nx = [] ( any_ptr p, int n, bool xd, bool rec ) {
-			auto add = [ & ] ( ia32::pt_entry_64* e ) {
-				if ( e->execute_disable == xd ) return;
-
-				if ( xd ) {
-					if ( xstd::atomic_bit_set( e->flags, PT_ENTRY_64_EXECUTE_DISABLE_BIT ) ) return;
-				} else {
-					if ( !xstd::atomic_bit_reset( e->flags, PT_ENTRY_64_EXECUTE_DISABLE_BIT ) ) return;
-				}
-				revert_list[ revert_list_i++ ] = { e, xd };
-			};
-
-			while ( n > 0 ) {
-				__hint_unroll()
-				for ( int8_t d = ia32::mem::pxe_level; d >= ia32::mem::pte_level; d-- ) {
-					auto e = ia32::mem::get_pte( p, d );
-
-					// If present:
-					if ( e->present ) {
-						// If not PTE and not large page, move to next level.
-						if ( d != ia32::mem::pte_level && !e->large_page ) {
-							if ( rec ) add( e );
-							continue;
-						}
-
-						// Add the entry.
-						add( e );
-						ia32::invlpg( p );
-					}
-
-					// Onto the next one.
-					p += ia32::mem::page_size( d );
-					n -= ia32::mem::page_size( d );
-					break;
-				}
-			}
-		};
+		// Make sure the test page is no-execute.
+		//
+		paging.set_nx( page, 0x1000, true, false );
+
+		// Make sure the code page we're executing / IDT / GDT / TSS / Page tables associated are not set NX.
+		//
+		paging.set_nx( impl::idt.data(), 0x1000, false, true );
+		for ( size_t n = 0; n != 0x100; n++ )
+			paging.set_nx( impl::idt[ n ].get_handler(), 0x1000, false, true );
+		auto [gdt, lim] = ia32::get_gdt();
+		paging.set_nx( gdt, ( lim + 1 ) * sizeof( ia32::gdt_entry ), false, true );
+		auto* tss = ( ( ia32::tss_entry* ) &gdt[ ia32::get_tr().index ] );
+		paging.set_nx( tss->get_offset(), tss->get_limit() + 1, false, true );
+		paging.set_nx( ia32::get_ip(), 0x2000, false, true );
+		paging.set_nx( ia32::get_sp() - 0x500, 0x2000, false, true );
+
+		// If the revert log could not fit the entries, skip the test.
+		//
+		if ( paging.overflow )
+		{
+			result[ "nxSkipped" ] = paging.needed;
+			return;
+		}
 
 		interrupt_counters ctrs = {};
 		{
 			interrupt_guard _g{ &ctrs };
-
-			// Make sure the test page is no-execute.
-			//
-			set_nx( page, 0x1000, true, false );
-
-			// Make sure the code page we're executing / IDT / GDT / TSS / Page tables associated are not set NX.
-			//
-			set_nx( impl::idt.data(), 0x1000, false, true );
-			for ( size_t n = 0; n != 0x100; n++ )
-				set_nx( impl::idt[ n ].get_handler(), 0x1000, false, true );
-			auto [gdt, lim] = ia32::get_gdt();
-			set_nx( gdt, ( lim + 1 ) * sizeof( ia32::gdt_entry ), false, true );
-			auto* tss = ( ( ia32::tss_entry* ) &gdt[ ia32::get_tr().index ] );
-			set_nx( tss->get_offset(), tss->get_limit() + 1, false, true );
-			set_nx( ia32::get_ip(), 0x2000, false, true );
-			set_nx( ia32::get_sp() - 0x500, 0x2000, false, true );
+			paging.commit();
 
 			// Disable NX in EFER.
 			//
@@ -625,15 +822,7 @@ namespace processor
 			efer.execute_disable_bit_enable = true;
 			ia32::write_msr( IA32_EFER, efer );
 
-			for ( size_t i = 0; i != revert_list_i; i++ ) {
-				auto [e, xd] = revert_list[ i ];
-				if ( xd ) {
-					xstd::atomic_bit_reset( e->flags, PT_ENTRY_64_EXECUTE_DISABLE_BIT );
-				} else {
-					xstd::atomic_bit_set( e->flags, PT_ENTRY_64_EXECUTE_DISABLE_BIT );
-				}
-			}
-			revert_list_i = 0;
+			paging.rollback();
 		}
 
 		// Save the detection.
@@ -688,18 +877,157 @@ namespace processor
 		constexpr auto fn_cpuid = [ ] () FORCE_INLINE { ia32::query_cpuid( 0 ); };
 		constexpr auto fn_xsetbv = [ ] () FORCE_INLINE { ia32::write_xcr( 0, defxcr0 ); };
 		constexpr auto fn_smi = [ ] () FORCE_INLINE { ia32::write_io( 0xB2, 0 ); };
+		constexpr auto fn_guard = [ ] () FORCE_INLINE { interrupt_guard _g{}; };
+		constexpr auto fn_bind = [ ] () FORCE_INLINE { interrupt_session::bind( ( interrupt_counters* ) ia32::read_gsbase() ); };
 
 		result[ "nop" ] = benchmark::run( benchmark::wrap_no_obfuscation( fn_nop ) );
 		result[ "alu" ] = benchmark::run( benchmark::wrap_no_obfuscation( fn_alu ) );
 		result[ "cpuid" ] = benchmark::run( benchmark::wrap_no_obfuscation( fn_cpuid ) );
 		result[ "smi" ] = benchmark::run( benchmark::wrap_no_obfuscation( fn_smi ) );
 		result[ "xsetbv" ] = benchmark::run( benchmark::wrap_no_obfuscation( fn_xsetbv ) );
+		result[ "guard" ] = benchmark::run( benchmark::wrap_no_obfuscation( fn_guard ) );
+		result[ "sessionBind" ] = benchmark::run( benchmark::wrap_no_obfuscation( fn_bind ) );
+		result[ "exceptions" ] = benchmark::run_exceptions();
 		result[ "nopLong" ] = benchmark::run( benchmark::wrap_fixed_duration( fn_nop ) );
 		result[ "aluLong" ] = benchmark::run( benchmark::wrap_fixed_duration( fn_alu ) );
 		result[ "cpuidLong" ] = benchmark::run( benchmark::wrap_fixed_duration( fn_cpuid ) );
 		result[ "smiLong" ] = benchmark::run( benchmark::wrap_fixed_duration( fn_smi ) );
 		result[ "xsetbvLong" ] = benchmark::run( benchmark::wrap_fixed_duration( fn_xsetbv ) );
+
+		// Time each XSAVE variant across the XCR0 feature masks, reusing the preallocated area.
+		// - Gated on the same capability checks as the state-size test, XSAVES additionally needs a readable IA32_XSS.
+		//
+		if ( xsave_supported( xsave_variant::xsave ) )
+		{
+			bool with_xsaves = xsave_supported( xsave_variant::xsaves );
+			if ( with_xsaves )
+			{
+				interrupt_counters ctrs = {};
+				{
+					interrupt_guard _g{ &ctrs };
+					probe::read_msr( IA32_XSS );
+				}
+				with_xsaves = !ctrs.has_exception();
+			}
+
+			constexpr auto fn_xsave = [ ] () FORCE_INLINE { xsave_to<xsave_variant::xsave>( xsave_area, xsave_rfbm ); };
+			constexpr auto fn_xsaveopt = [ ] () FORCE_INLINE { xsave_to<xsave_variant::xsaveopt>( xsave_area, xsave_rfbm ); };
+			constexpr auto fn_xsavec = [ ] () FORCE_INLINE { xsave_to<xsave_variant::xsavec>( xsave_area, xsave_rfbm ); };
+			constexpr auto fn_xsaves = [ ] () FORCE_INLINE { xsave_to<xsave_variant::xsaves>( xsave_area, xsave_rfbm ); };
+
+			auto& xsave_list = result[ "xsave" ].array();
+			uint64_t prev_rfbm = 0;
+			for ( uint64_t mask : { 0x3ull /*x87|SSE*/, 0x7ull /*+AVX*/, ~0ull } )
+			{
+				xsave_rfbm = defxcr0 & mask;
+				if ( std::exchange( prev_rfbm, xsave_rfbm ) == xsave_rfbm )
+					continue;
+
+				cbor::object_t entry = {};
+				entry[ "mask" ] = xsave_rfbm;
+				entry[ "xsave" ] = benchmark::run( benchmark::wrap_no_obfuscation( fn_xsave ) );
+				if ( xsave_supported( xsave_variant::xsaveopt ) )
+					entry[ "xsaveopt" ] = benchmark::run( benchmark::wrap_no_obfuscation( fn_xsaveopt ) );
+				if ( xsave_supported( xsave_variant::xsavec ) )
+					entry[ "xsavec" ] = benchmark::run( benchmark::wrap_no_obfuscation( fn_xsavec ) );
+				if ( with_xsaves )
+					entry[ "xsaves" ] = benchmark::run( benchmark::wrap_no_obfuscation( fn_xsaves ) );
+				xsave_list.emplace_back( std::move( entry ) );
+			}
+		}
+	}
+};
+
+// Registry of the detection tests in execution order.
+//
+namespace registry
+{
+	using detection::cost_class;
+	using detection::risk_class;
+	using detection::vendor_gate;
+
+	// Detection keys produced by each test.
+	//
+	static constexpr const char* smi_keys[] =   { "vm.smiSuppressed" };
+	static constexpr const char* vmw_keys[] =   { "vm.vmwareIo" };
+	static constexpr const char* info_keys[] =  { "vm.hvFlagSet", "vm.nullClock" };
+	static constexpr const char* str_keys[] =   { "vm.strEmulFail", "vm.sldtEmulFail" };
+	static constexpr const char* int_keys[] =   { "vm.dbSuppressed" };
+	static constexpr const char* po_keys[] =    { "vm.turboSuppressed" };
+	static constexpr const char* pm_keys[] =    { "vm.pmcMsrMismatch", "vm.rdpmcMismatch", "vm.rdpmcFaulted", "vm.pmcDead", "vm.pebsSuppressed" };
+	static constexpr const char* dbg_keys[] =   { "vm.lbrSuppressed", "vm.btsOsFault", "vm.btsOsSuppressed", "vm.btfSuppressed", "vm.ptSuppressed" };
+	static constexpr const char* id_keys[] =    { "vm.cpuidEcxSuppressed" };
+	static constexpr const char* xsave_keys[] = { "vm.xsaveSizeMismatch", "vm.xsavesSizeMismatch", "vm.xsaveFaulted", "vm.xsaveOverflow" };
+	static constexpr const char* clk_keys[] =   { "vm.hiddenClocks", "vm.tscWarped" };
+	static constexpr const char* cr_keys[] =    { "vm.xgetbvEmulFail", "vm.xsetbvLeafEmulFail", "vm.xsetbvLeafEmulFail2", "vm.xsetbvValueEmulFail", "vm.smswEmulFail" };
+	static constexpr const char* msr_keys[] =   { "vm.msrDefaultInvalid", "vm.hvMsrs", "vm.tscMsrEmulFail" };
+	static constexpr const char* nx_keys[] =    { "vm.eferNxDiscard" };
+
+	// Detection keys produced by the exports themselves rather than by a test.
+	//
+	static constexpr const char* export_keys[] = { "vm.vmxe", "vm.perCoreMismatch" };
+
+	// Dependencies, the clock tests rely on benchmark::has_* set by collect_info.
+	//
+	static constexpr const char* after_info[] = { "info" };
+
+	static constexpr detection::test_descriptor tests[] = {
+		{ "smi",   "northbridge", cost_class::moderate, risk_class::safe,     vendor_gate::intel, smi_keys,   &detection::adapt<northbridge::test_smi>, {}, detection::exclusive },
+		{ "vmw",   "northbridge", cost_class::fast,     risk_class::safe,     vendor_gate::any,   vmw_keys,   &detection::adapt<northbridge::test_vmw>, {}, detection::invariant },
+		{ "info",  "processor",   cost_class::fast,     risk_class::safe,     vendor_gate::any,   info_keys,  &detection::adapt<processor::collect_info>, {}, detection::invariant },
+		{ "str",   "processor",   cost_class::fast,     risk_class::safe,     vendor_gate::any,   str_keys,   &detection::adapt<processor::test_str>, {}, detection::invariant | detection::sweepable },
+		{ "int",   "processor",   cost_class::fast,     risk_class::safe,     vendor_gate::any,   int_keys,   &detection::adapt<processor::test_int> },
+		{ "po",    "processor",   cost_class::fast,     risk_class::safe,     vendor_gate::intel, po_keys,    &detection::adapt<processor::test_po> },
+		{ "pm",    "processor",   cost_class::fast,     risk_class::safe,     vendor_gate::any,   pm_keys,    &detection::adapt<processor::test_pm> },
+		{ "dbg",   "processor",   cost_class::fast,     risk_class::safe,     vendor_gate::any,   dbg_keys,   &detection::adapt<processor::test_dbg> },
+		{ "id",    "processor",   cost_class::fast,     risk_class::safe,     vendor_gate::any,   id_keys,    &detection::adapt<processor::test_id>, {}, detection::invariant | detection::sweepable },
+		{ "xsave", "processor",   cost_class::fast,     risk_class::safe,     vendor_gate::any,   xsave_keys, &detection::adapt<processor::test_xsave>, {}, detection::invariant },
+		{ "clk",   "processor",   cost_class::fast,     risk_class::safe,     vendor_gate::any,   clk_keys,   &detection::adapt<processor::test_clk>, after_info, detection::sweepable },
+		{ "cr",    "processor",   cost_class::fast,     risk_class::advanced, vendor_gate::any,   cr_keys,    &detection::adapt<processor::test_cr>, {}, detection::sweepable },
+		{ "msr",   "processor",   cost_class::fast,     risk_class::advanced, vendor_gate::any,   msr_keys,   &detection::adapt<processor::test_msr>, after_info, detection::sweepable },
+		{ "nx",    "processor",   cost_class::moderate, risk_class::advanced, vendor_gate::any,   nx_keys,
+			[ ] ( cbor::object_t& result, cbor::object_t& detections, const detection::context& ctx ) { processor::test_nx( ctx.page, *ctx.paging, result, detections ); },
+			{}, detection::exclusive },
+	};
+	static constexpr detection::test_descriptor bench = {
+		"benchmarks", "benchmarks", cost_class::slow, risk_class::safe, vendor_gate::any, {}, &detection::adapt<processor::run_bench>
+	};
+
+	// Checks that the scoring table and the registry agree, every weighted key is produced somewhere and every key a
+	// test produces is weighted.
+	//
+	static consteval bool produced( std::string_view key )
+	{
+		for ( auto& test : tests )
+			if ( test.produces( key ) )
+				return true;
+		for ( auto* k : export_keys )
+			if ( key == k )
+				return true;
+		return false;
 	}
+	static consteval bool weighted( std::string_view key )
+	{
+		for ( auto& w : scoring::detection_weights )
+			if ( key == w.key )
+				return true;
+		return false;
+	}
+	static consteval bool scoring_matches_registry()
+	{
+		for ( auto& w : scoring::detection_weights )
+			if ( !produced( w.key ) )
+				return false;
+		for ( auto& test : tests )
+			for ( auto* k : test.keys )
+				if ( !weighted( k ) )
+					return false;
+		for ( auto* k : export_keys )
+			if ( !weighted( k ) )
+				return false;
+		return true;
+	}
+	static_assert( scoring_matches_registry(), "Scoring weights do not match the detection keys of the registry." );
 };
 
 extern "C" [[gnu::dllexport]] transport::packet* dbgDetect()
@@ -726,92 +1054,138 @@ extern "C" [[gnu::dllexport]] transport::packet* dbgDetect()
 }
 
 // Must be called at IRQL = 2.
+// - Input optionally selects the tests to run, see detection::selection.
+// - Detection keys of the tests that were not selected or did not complete are listed under "untested".
 //
 static std::atomic<bool> clock_latch = false;
-extern "C" [[gnu::dllexport]] transport::packet* hvDetectBasic()
+extern "C" [[gnu::dllexport]] transport::packet* hvDetectBasic( cbor::instance* input )
 {
 	cbor::instance result = {};
 	auto& detections = result[ "detections" ].object();
 	auto& data = result[ "data" ].object();
-	auto& nb_data = data[ "northbridge" ].object();
-	auto& bench_data = data[ "benchmarks" ].object();
-	auto& cpu_data = data[ "processor" ].object();
+	auto& ran = result[ "tests" ].array();
+	auto& timings = result[ "timing" ].object();
+	auto sel = detection::selection::parse( input );
+	detection::context ctx{ data, detections };
+	auto sched = std::make_unique<detection::scheduler>( registry::tests, sel, detection::risk_class::safe );
+	timing::stopwatch total = {};
+
+	// Skip the benchmarks if not selected or if their last run exceeded the budget.
+	//
+	static uint64_t bench_last_cycles = 0;
+	uint64_t bench_cycles = 0;
+	bool bench_ran = false;
+	uint64_t bench_budget = sel.budget_of( registry::bench.name );
+	bool with_bench = sel.allows( registry::bench );
+	bool bench_skipped = with_bench && bench_budget && bench_last_cycles > bench_budget;
+	if ( bench_skipped )
+	{
+		bench_last_cycles /= 2;
+		with_bench = false;
+	}
 
 	// Flag if VMXE is enabled.
 	//
 	detections[ "vm.vmxe" ] = (bool) ia32::read_cr4().vmx_enable;
+	sched->score.add( detections );
 
-	// Test the northbridge.
+	// Run the northbridge and basic processor tests spread across the processors, then the benchmarks.
+	// - Skipped entirely if every selected test was served from the cache.
+	// - Benchmarks are skipped if the posterior already crossed the stopping threshold, it is final once work returns.
 	//
-	ntpp::call_dpc( [ & ]() __attribute__( ( __virtualize__ ) ) {
-		if ( nt::read_pcid() == 0 ) {
-			northbridge::test_smi( nb_data, detections );
-			northbridge::test_vmw( nb_data, detections );
-		}
-	} );
+	if ( sched->pending_work() || with_bench )
+	{
+		ntpp::call_dpc( [ & ]() __attribute__( ( __virtualize__ ) ) {
+			sched->work( ctx );
+			if ( !with_bench || sched->score.conclusive() )
+				return;
 
-	// Run basic processor tests.
-	//
-	ntpp::call_dpc( [ & ]() __attribute__( ( __virtualize__ ) ) {
-		if ( nt::read_pcid() == 0 ) {
-			processor::collect_info( cpu_data, detections );
-			processor::test_int( cpu_data, detections );
-			processor::test_po( cpu_data, detections );
-			processor::test_pm( cpu_data, detections );
-			processor::test_dbg( cpu_data, detections );
-			processor::test_id( cpu_data, detections );
-			processor::test_clk( cpu_data, detections );
-		}
-	} );
-
-	ntpp::call_dpc( [ & ]() __attribute__( ( __virtualize__ ) ) {
-		// Disable all PMCs.
-		//
-		ia32::pmu::fixed_disable( ia32::pmu::event_id::ins_retire );
-		ia32::pmu::fixed_disable( ia32::pmu::event_id::clock_core );
-		ia32::pmu::fixed_disable( ia32::pmu::event_id::clock_tsc );
-		for ( size_t n = 0; n != 8; n++ )
-			ia32::pmu::dynamic_disable( n );
-
-		// If first processor, run the benchmarks.
-		//
-		if ( nt::read_pcid() == 0 ) {
-			while ( !xstd::make_volatile( benchmark::mp_clock::jump_point ) )
-				yield_cpu();
-			processor::run_bench( bench_data, detections );
-			*benchmark::mp_clock::jump_point = 0xC3;
-			ia32::clflush( benchmark::mp_clock::jump_point );
-		}
-		// Otherwise use as a clock source until we're done if second.
-		//
-		else if ( !clock_latch.exchange( true ) ) {
-			ia32::set_irql( IPI_LEVEL - 1 );
-			benchmark::mp_clock::timer();
-			*benchmark::mp_clock::jump_point = 0xEB;
-			ia32::set_irql( DISPATCH_LEVEL );
-		}
-	} );
+			// Disable all PMCs.
+			//
+			ia32::pmu::fixed_disable( ia32::pmu::event_id::ins_retire );
+			ia32::pmu::fixed_disable( ia32::pmu::event_id::clock_core );
+			ia32::pmu::fixed_disable( ia32::pmu::event_id::clock_tsc );
+			for ( size_t n = 0; n != 8; n++ )
+				ia32::pmu::dynamic_disable( n );
+
+			// If first processor, run the benchmarks.
+			//
+			if ( nt::read_pcid() == 0 ) {
+				while ( !xstd::make_volatile( benchmark::mp_clock::jump_point ) )
+					yield_cpu();
+				timing::stopwatch sw = {};
+				registry::bench.run( ctx );
+				bench_cycles = sw.elapsed();
+				bench_ran = true;
+				*benchmark::mp_clock::jump_point = 0xC3;
+				ia32::clflush( benchmark::mp_clock::jump_point );
+			}
+			// Otherwise use as a clock source until we're done if second.
+			//
+			else if ( !clock_latch.exchange( true ) ) {
+				ia32::set_irql( IPI_LEVEL - 1 );
+				benchmark::mp_clock::timer();
+				*benchmark::mp_clock::jump_point = 0xEB;
+				ia32::set_irql( DISPATCH_LEVEL );
+			}
+		} );
+	}
 
+	// Merge the per-test results and timings.
+	//
+	sched->merge( ctx, ran, timings, result[ "untested" ].array() );
+	bool bench_stopped = with_bench && !bench_ran;
+	if ( bench_stopped )
+	{
+		with_bench = false;
+		bench_skipped = true;
+	}
+	if ( with_bench )
+	{
+		ran.emplace_back( registry::bench.name );
+		bench_last_cycles = bench_cycles;
+		classifier::report( result[ "classification" ].object(), data[ registry::bench.section ].object() );
+	}
+	if ( with_bench || bench_skipped )
+		timing::record( timings, registry::bench.name, bench_cycles, bench_budget, bench_skipped );
+	timing::record( timings, "total", total.elapsed(), sel.total_budget );
+	scoring::report( result[ "score" ].object(), detections, data, sel.prior, sel.stop_at, sched->stopped_early() || bench_stopped );
 	return transport::serialize( result );
 }
-extern "C" [[gnu::dllexport]] transport::packet* hvDetectAdvanced()
+extern "C" [[gnu::dllexport]] transport::packet* hvDetectAdvanced( cbor::instance* input )
 {
 	cbor::instance result = {};
 	auto& detections = result[ "detections" ].object();
 	auto& data = result[ "data" ].object();
-	auto& cpu_data = data[ "processor" ].object();
+	auto& ran = result[ "tests" ].array();
+	auto& timings = result[ "timing" ].object();
+	auto sel = detection::selection::parse( input );
+	auto sched = std::make_unique<detection::scheduler>( registry::tests, sel, detection::risk_class::advanced );
+	timing::stopwatch total = {};
 
-	volatile uint8_t* page = mm::allocate_independent_pages( 0x1000, -1ll );
-	ntpp::call_ipi( [ & ]() __attribute__((__virtualize__)) {
-		if ( nt::read_pcid() == 0 ) {
+	if ( sched->pending_work() )
+	{
+		// Reserve the page table transaction ahead of the broadcast for the ranges test_nx stages, growing it if the
+		// last one still overflowed on a processor whose tables differ from the current one.
+		//
+		static size_t paging_capacity = 0;
+		pt_transaction paging = {};
+		paging.reserve( std::max( paging_capacity, processor::nx_entries() ) );
+
+		volatile uint8_t* page = mm::allocate_independent_pages( 0x1000, -1ll );
+		detection::context ctx{ data, detections, page, &paging };
+		ntpp::call_ipi( [ & ]() __attribute__((__virtualize__)) {
 			// Run advanced processor tests with the risk of crashing the hypervisor if we did not log any detections yet.
 			//
-			processor::test_cr( cpu_data, detections );
-			processor::test_msr( cpu_data, detections );
-			processor::test_nx( page, cpu_data, detections );
-		}
-	});
-	mm::free_independent_pages( page, 0x1000 );
+			sched->work( ctx );
+		});
+		mm::free_independent_pages( page, 0x1000 );
+		if ( paging.overflow )
+			paging_capacity = std::bit_ceil( paging.needed );
+	}
 
+	sched->merge( { data, detections }, ran, timings, result[ "untested" ].array() );
+	timing::record( timings, "total", total.elapsed(), sel.total_budget );
+	scoring::report( result[ "score" ].object(), detections, data, sel.prior, sel.stop_at, sched->stopped_early() );
 	return transport::serialize( result );
 }
@@ -0,0 +1,252 @@
+#pragma once
+#include <span>
+#include <vector>
+#include <memory>
+#include <optional>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include "simd.hpp"
+
+// Relocation-aware comparison of the sections of a loaded image against its file, independent of how the file is read
+// so that it can be tested in user mode.
+// - The loader rewrites the 64-bit relocations and the import address table. The relocation table keeps the sorted
+//   RVAs of the former and the range of the latter, four bytes per relocation rather than a bit per compared byte.
+// - Sections are compared chunk by chunk with a masked kernel, the mask of the bytes to skip is built for one chunk at
+//   a time from the table so the retained state stays small.
+// - Readers provide size_t read( uint64_t offset, uint8_t* out, size_t n ) returning the number of bytes read.
+//
+namespace integrity
+{
+	static constexpr uint16_t rel_based_dir64 = 10;
+
+	// Hashes a range with the given kernel.
+	//
+	inline uint64_t hash_range( simd::level lv, const void* p, size_t n )
+	{
+		simd::lane_hash h{ lv };
+		h.update( ( const uint8_t* ) p, n );
+		return h.digest();
+	}
+
+	// Hash of a single executable section.
+	//
+	struct section_hash
+	{
+		uint32_t rva = 0;
+		uint32_t length = 0;
+		uint64_t hash = 0;
+		bool operator==( const section_hash& ) const = default;
+	};
+
+	// Section header fields needed once the header chunk is gone.
+	//
+	struct section
+	{
+		uint32_t rva;
+		uint32_t length;
+		uint32_t raw;
+		bool compared;
+	};
+	inline std::optional<uint32_t> rva_to_raw( std::span<const section> sections, uint32_t rva )
+	{
+		for ( auto& s : sections )
+			if ( s.rva <= rva && rva < ( s.rva + s.length ) )
+				return s.raw + ( rva - s.rva );
+		return std::nullopt;
+	}
+
+	// Bytes written by the loader within the compared sections.
+	//
+	struct relocation_table
+	{
+		std::vector<section_hash> sections = {}; // Compared sections the table was built for, hash unused.
+		std::vector<uint32_t> rvas = {};         // Sorted RVAs of the 64-bit relocations within them.
+		uint32_t iat_begin = 0;
+		uint32_t iat_end = 0;
+
+		// Checks whether or not the table was built for the compared sections.
+		//
+		bool matches( std::span<const section> list ) const
+		{
+			auto it = sections.begin();
+			for ( auto& s : list )
+			{
+				if ( !s.compared )
+					continue;
+				if ( it == sections.end() || it->rva != s.rva || it->length != s.length )
+					return false;
+				++it;
+			}
+			return it == sections.end();
+		}
+
+		// Number of bytes retained by the table.
+		//
+		size_t retained_size() const
+		{
+			return sizeof( *this ) + sections.capacity() * sizeof( section_hash ) + rvas.capacity() * sizeof( uint32_t );
+		}
+
+		// Sets the bits of the bytes of [first, last) that fall within [begin, end).
+		//
+		static void mark( uint64_t* out, uint64_t begin, uint64_t end, uint64_t first, uint64_t last )
+		{
+			first = std::max( first, begin );
+			last = std::min( last, end );
+			for ( uint64_t i = first - begin; ( i + begin ) < last; )
+			{
+				uint64_t count = std::min( 64 - ( i % 64 ), last - begin - i );
+				uint64_t m = count == 64 ? ~0ull : ( ( 1ull << count ) - 1 );
+				out[ i / 64 ] |= m << ( i % 64 );
+				i += count;
+			}
+		}
+
+		// Builds the mask of the range starting at the RVA, bit i of word w covers byte 64 * w + i of the range.
+		//
+		void mask( uint32_t rva, uint32_t length, uint64_t* out ) const
+		{
+			uint64_t end = uint64_t( rva ) + length;
+			std::fill_n( out, ( size_t( length ) + 63 ) / 64, 0ull );
+			for ( auto it = std::lower_bound( rvas.begin(), rvas.end(), rva > 7 ? rva - 7 : 0 ); it != rvas.end() && *it < end; ++it )
+				mark( out, rva, end, *it, uint64_t( *it ) + 8 );
+			if ( iat_begin < end && rva < iat_end )
+				mark( out, rva, end, iat_begin, iat_end );
+		}
+	};
+	using relocations = std::shared_ptr<const relocation_table>;
+
+	// Invokes the callback with the RVA of every 64-bit relocation in the relocation directory.
+	//
+	template<typename R, typename F>
+	inline bool read_relocations( const R& file, std::span<uint8_t> buffer, uint64_t offset, size_t size, F&& fn )
+	{
+		size_t carried = 0;
+		while ( true )
+		{
+			size_t n = file.read( offset, buffer.data() + carried, std::min( size, buffer.size() - carried ) );
+			if ( !n && size )
+				return false;
+			offset += n;
+			size -= n;
+			n += carried;
+
+			// Consume the blocks fully contained in the buffer.
+			//
+			size_t it = 0;
+			while ( ( it + 8 ) <= n )
+			{
+				uint32_t page, length;
+				memcpy( &page, buffer.data() + it, 4 );
+				memcpy( &length, buffer.data() + it + 4, 4 );
+				if ( length < 8 || length > buffer.size() )
+					return false;
+				if ( ( it + length ) > n )
+					break;
+				for ( size_t e = it + 8; ( e + 2 ) <= ( it + length ); e += 2 )
+				{
+					uint16_t entry;
+					memcpy( &entry, buffer.data() + e, 2 );
+					if ( ( entry >> 12 ) == rel_based_dir64 )
+						fn( page + ( entry & 0xFFF ) );
+				}
+				it += length;
+			}
+
+			// Move the partial block to the front, anything left at the end can only be padding.
+			//
+			carried = n - it;
+			if ( !size )
+			{
+				if ( carried >= 8 )
+					return false;
+				break;
+			}
+			memmove( buffer.data(), buffer.data() + it, carried );
+		}
+		return true;
+	}
+
+	// Builds the relocation table of the compared sections from the relocation directory and the import address table.
+	//
+	template<typename R>
+	inline relocations build_relocations( const R& file, std::span<uint8_t> buffer, std::span<const section> sections,
+		uint32_t reloc_rva, uint32_t reloc_size, uint32_t iat_rva, uint32_t iat_size )
+	{
+		auto table = std::make_shared<relocation_table>();
+		for ( auto& s : sections )
+			if ( s.compared )
+				table->sections.push_back( { s.rva, s.length } );
+		auto compared = [ & ] ( uint32_t rva )
+		{
+			for ( auto& s : table->sections )
+				if ( rva < ( s.rva + s.length ) && s.rva < ( uint64_t( rva ) + 8 ) )
+					return true;
+			return false;
+		};
+
+		if ( reloc_size )
+		{
+			auto raw = rva_to_raw( sections, reloc_rva );
+			if ( !raw || !read_relocations( file, buffer, *raw, reloc_size, [ & ] ( uint32_t rva ) { if ( compared( rva ) ) table->rvas.push_back( rva ); } ) )
+				return nullptr;
+		}
+		std::sort( table->rvas.begin(), table->rvas.end() );
+		table->rvas.erase( std::unique( table->rvas.begin(), table->rvas.end() ), table->rvas.end() );
+		table->rvas.shrink_to_fit();
+		if ( iat_size )
+		{
+			table->iat_begin = iat_rva;
+			table->iat_end = iat_rva + iat_size;
+		}
+		return table;
+	}
+
+	// Outcome of the comparison.
+	//
+	struct comparison
+	{
+		bool read = false;
+		bool patched = false;
+		std::vector<section_hash> file = {};
+		std::vector<section_hash> memory = {};
+	};
+
+	// Compares the compared sections of the file against the image mapped at mem, hashing both.
+	// - Chunks are kept a multiple of 64 bytes so that each starts on a mask word.
+	// - Memory is hashed in the same pass, before each chunk is compared. A write racing with the pass can then
+	//   only leave a hash that no longer matches the image, never a hash of patched bytes next to a clean verdict.
+	//
+	template<typename R>
+	inline comparison compare_sections( const R& file, std::span<uint8_t> buffer, std::span<const section> sections,
+		const uint8_t* mem, const relocation_table& relocs, simd::level lv )
+	{
+		comparison result = {};
+		size_t step = buffer.size() & ~size_t( 63 );
+		std::vector<uint64_t> mask( step / 64 );
+		for ( auto& s : sections )
+		{
+			if ( !s.compared )
+				continue;
+			simd::lane_hash hash{ lv };
+			simd::lane_hash mem_hash{ lv };
+			for ( uint32_t pos = 0; pos < s.length; )
+			{
+				uint32_t length = uint32_t( std::min<size_t>( s.length - pos, step ) );
+				if ( file.read( s.raw + pos, buffer.data(), length ) != length )
+					return result;
+				hash.update( buffer.data(), length );
+				mem_hash.update( mem + s.rva + pos, length );
+				relocs.mask( s.rva + pos, length, mask.data() );
+				if ( !simd::equal_masked( lv, buffer.data(), mem + s.rva + pos, mask.data(), length ) )
+					result.patched = true;
+				pos += length;
+			}
+			result.file.push_back( { s.rva, s.length, hash.digest() } );
+			result.memory.push_back( { s.rva, s.length, mem_hash.digest() } );
+		}
+		result.read = true;
+		return result;
+	}
+};
@@ -0,0 +1,182 @@
+#pragma once
+#include <span>
+#include <vector>
+#include <memory>
+#include <optional>
+#include <algorithm>
+#include <cstring>
+#include <ntpp.hpp>
+#include <sdk/zw/api.hpp>
+#include <sdk/nt/file_network_open_information_t.hpp>
+#include "integrity_cache.hpp"
+
+// Streaming verification of a loaded image against its file.
+// - The file is read in fixed size chunks into a caller provided buffer, headers are parsed from the first chunk and
+//   the relocation directory is consumed block by block into the relocation table of the compared sections.
+// - Executable sections are then compared against the mapped image chunk by chunk, see image_compare.hpp.
+// - Tables only depend on the file and are kept in the integrity cache, a later verification of the same file skips
+//   the relocation directory entirely.
+// - Memory use is bounded by the chunk size and four bytes per relocation, not by the size of the file.
+//
+namespace image_stream
+{
+	static constexpr size_t chunk_size = 0x10000;
+
+	// Builds the object attributes of a path, the view has to outlive them.
+	//
+	struct path_attributes
+	{
+		win::unicode_string_t name;
+		win::object_attributes_t attributes;
+
+		path_attributes( std::wstring_view path )
+		{
+			name = {
+				.length =     uint16_t( path.size() * sizeof( wchar_t ) ),
+				.max_length = uint16_t( path.size() * sizeof( wchar_t ) ),
+				.buffer =     ( wchar_t* ) path.data(),
+			};
+			attributes = {
+				.length =      sizeof( win::object_attributes_t ),
+				.object_name = &name,
+				.attributes =  OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+			};
+		}
+		path_attributes( const path_attributes& ) = delete;
+	};
+
+	// Queries the last write time of a file.
+	//
+	inline std::optional<int64_t> query_last_write( std::wstring_view path )
+	{
+		path_attributes pa{ path };
+		nt::file_network_open_information_t info = {};
+		if ( !NT_SUCCESS( zw::query_full_attributes_file( &pa.attributes, &info ) ) )
+			return std::nullopt;
+		return info.last_write_time;
+	}
+
+	// Read-only file handle.
+	//
+	struct file
+	{
+		HANDLE handle = nullptr;
+
+		file( std::wstring_view path )
+		{
+			path_attributes pa{ path };
+			nt::io_status_block_t iosb = {};
+			if ( !NT_SUCCESS( zw::create_file( &handle, GENERIC_READ | SYNCHRONIZE, &pa.attributes, &iosb, nullptr, FILE_ATTRIBUTE_NORMAL,
+				FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, FILE_OPEN, FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE, nullptr, 0 ) ) )
+				handle = nullptr;
+		}
+		file( const file& ) = delete;
+		~file() { if ( handle ) zw::close( handle ); }
+		explicit operator bool() const { return handle != nullptr; }
+
+		// Reads up to n bytes at the offset, returns the number of bytes read.
+		//
+		size_t read( uint64_t offset, uint8_t* out, size_t n ) const
+		{
+			nt::io_status_block_t iosb = {};
+			int64_t position = int64_t( offset );
+			if ( !NT_SUCCESS( zw::read_file( handle, nullptr, nullptr, nullptr, &iosb, out, uint32_t( n ), &position, nullptr ) ) )
+				return 0;
+			return iosb.information;
+		}
+	};
+
+	// Outcome of the verification.
+	//
+	struct verdict
+	{
+		bool read = false;
+		bool checksum_match = false;
+		bool layout_match = false;
+		bool patched = false;
+		std::vector<integrity::section_hash> file = {};
+		std::vector<integrity::section_hash> memory = {};
+		integrity::relocations relocs = {};
+	};
+
+	// Verifies the image against the file at the path using the buffer for every read.
+	// - A relocation table previously built for the same file can be passed in to skip the relocation directory.
+	//
+	inline verdict verify( std::wstring_view path, const win::image_x64_t* mem_img, std::span<uint8_t> buffer, integrity::relocations relocs = {} )
+	{
+		verdict result = {};
+		file f{ path };
+		if ( !f )
+			return result;
+
+		// Parse the headers.
+		//
+		size_t n = f.read( 0, buffer.data(), buffer.size() );
+		auto* fs_img = ( const win::image_x64_t* ) buffer.data();
+		if ( n < sizeof( win::dos_header_t ) || fs_img->get_dos_headers()->e_magic != win::DOS_HDR_MAGIC )
+			return result;
+		auto* hdrs = fs_img->get_nt_headers();
+		if ( ( ( const uint8_t* ) hdrs - buffer.data() + sizeof( *hdrs ) ) > n )
+			return result;
+		auto scns = hdrs->sections();
+		if ( ( ( const uint8_t* ) ( scns.data() + scns.size() ) - buffer.data() ) > n )
+			return result;
+		result.read = true;
+
+		// Skip if the checksum does not match.
+		//
+		if ( mem_img->get_nt_headers()->optional_header.checksum != hdrs->optional_header.checksum )
+			return result;
+		result.checksum_match = true;
+
+		std::vector<integrity::section> sections;
+		for ( auto& scn : scns )
+		{
+			bool compared = scn.characteristics.mem_execute && !scn.characteristics.mem_write && !scn.characteristics.mem_discardable;
+			sections.push_back( { scn.virtual_address, std::min( scn.virtual_size, scn.size_raw_data ), scn.ptr_raw_data, compared } );
+		}
+
+		// Skip unless every compared section is found at the same place in the image and lies within it. A file of the
+		// same checksum can still have a different layout, and its offsets cannot be trusted against the mapping.
+		//
+		auto* mem_hdrs = mem_img->get_nt_headers();
+		for ( auto& s : sections )
+		{
+			if ( !s.compared )
+				continue;
+			bool found = false;
+			for ( auto& scn : mem_hdrs->sections() )
+				found |= scn.virtual_address == s.rva && s.length <= scn.virtual_size;
+			if ( !found || ( uint64_t( s.rva ) + s.length ) > mem_hdrs->optional_header.size_image )
+				return result;
+		}
+		result.layout_match = true;
+
+		auto& dirs = hdrs->optional_header.data_directories;
+		auto reloc_dir = dirs.basereloc_directory;
+		auto iat_dir = dirs.iat_directory;
+
+		// Build the relocation table unless the given one still fits.
+		//
+		if ( !relocs || !relocs->matches( sections ) )
+		{
+			relocs = integrity::build_relocations( f, buffer, sections, reloc_dir.rva, reloc_dir.size, iat_dir.rva, iat_dir.size );
+			if ( !relocs )
+			{
+				result.read = false;
+				return result;
+			}
+		}
+		result.relocs = relocs;
+
+		// Compare the sections.
+		//
+		simd::scope vec{};
+		auto cmp = integrity::compare_sections( f, buffer, sections, ( const uint8_t* ) mem_img, *relocs, vec.lv );
+		result.read = cmp.read;
+		result.patched = cmp.patched;
+		result.file = std::move( cmp.file );
+		result.memory = std::move( cmp.memory );
+		return result;
+	}
+};
@@ -0,0 +1,148 @@
+#pragma once
+#include <span>
+#include <algorithm>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <string>
+#include <optional>
+#include <ntpp.hpp>
+#include <sdk/ex/api.hpp>
+#include <sdk/ke/api.hpp>
+#include "image_compare.hpp"
+
+// Cache of the driver images verified against their files.
+// - Entries are keyed by the path and base of the image, the checksum and timestamp of its headers and the last write
+//   time of the file, a change of any of them invalidates the entry.
+// - Each entry keeps the hashes of the executable sections both on disk and in memory, an image whose memory hashes
+//   still match can reuse the verdict without reading the file again.
+// - Each entry also keeps the relocation table of its file, which only depends on the file and is shared with any
+//   later verification of the same file, even at another base.
+//
+namespace integrity
+{
+	// Hashes the executable sections of the image, file images are addressed by raw offsets.
+	// - Discardable sections are skipped since they are freed after initialization, writable ones since they may
+	//   legitimately change.
+	//
+	inline std::vector<section_hash> hash_sections( const win::image_x64_t* img, bool file )
+	{
+		std::vector<section_hash> result;
+		simd::scope vec{};
+		for ( auto& scn : img->get_nt_headers()->sections() )
+		{
+			if ( !scn.characteristics.mem_execute || scn.characteristics.mem_write || scn.characteristics.mem_discardable )
+				continue;
+			uint32_t length = std::min( scn.virtual_size, scn.size_raw_data );
+			auto* data = img->raw_to_ptr<uint8_t>( file ? scn.ptr_raw_data : scn.virtual_address );
+			result.push_back( { scn.virtual_address, length, hash_range( vec.lv, data, length ) } );
+		}
+		return result;
+	}
+
+	// Identity of a loaded image and its file.
+	//
+	struct key
+	{
+		std::wstring path = {};
+		uint64_t base = 0;
+		uint32_t checksum = 0;
+		uint32_t timestamp = 0;
+		int64_t last_write = 0;
+		bool operator==( const key& ) const = default;
+
+		// Checks whether or not the key refers to the same file, the base is irrelevant.
+		//
+		bool same_file( const key& o ) const
+		{
+			return path == o.path && checksum == o.checksum && timestamp == o.timestamp && last_write == o.last_write;
+		}
+
+		static key of( const ldr::km::data_table_entry_t* img, int64_t last_write )
+		{
+			auto* hdrs = ( ( const win::image_x64_t* ) img->dll_base )->get_nt_headers();
+			return {
+				.path = std::wstring{ std::wstring_view{ img->full_dll_name } },
+				.base = ( uint64_t ) img->dll_base,
+				.checksum = hdrs->optional_header.checksum,
+				.timestamp = hdrs->file_header.timedate_stamp,
+				.last_write = last_write,
+			};
+		}
+	};
+
+	struct entry
+	{
+		key id = {};
+		bool patched = false;
+		std::vector<section_hash> file = {};
+		std::vector<section_hash> memory = {};
+		relocations relocs = {};
+	};
+
+	// Exclusive push lock, its holder stays at PASSIVE_LEVEL and may allocate or be preempted without spinning the
+	// other workers.
+	//
+	struct push_lock
+	{
+		uint64_t value = 0;
+
+		void lock()
+		{
+			ke::enter_critical_region();
+			ex::acquire_push_lock_exclusive_ex( &value, 0 );
+		}
+		void unlock()
+		{
+			ex::release_push_lock_exclusive_ex( &value, 0 );
+			ke::leave_critical_region();
+		}
+	};
+
+	// Persistent cache, shared by the workers.
+	//
+	struct cache
+	{
+		static constexpr size_t capacity = 1024;
+		inline static std::vector<entry> entries = {};
+		inline static push_lock lock = {};
+
+		// Finds the entry of the key and returns the verdict if the memory hashes still match, the relocation table of
+		// any entry of the same file is returned regardless.
+		//
+		static std::optional<bool> lookup( const key& id, const win::image_x64_t* img, relocations& relocs )
+		{
+			std::vector<section_hash> expected;
+			bool patched;
+			{
+				std::lock_guard _g{ lock };
+				auto it = entries.end();
+				for ( auto e = entries.begin(); e != entries.end(); ++e )
+				{
+					if ( e->relocs && e->id.same_file( id ) )
+						relocs = e->relocs;
+					if ( e->id == id )
+						it = e;
+				}
+				if ( it == entries.end() )
+					return std::nullopt;
+				expected = it->memory;
+				patched = it->patched;
+			}
+			if ( hash_sections( img, false ) != expected )
+				return std::nullopt;
+			return patched;
+		}
+
+		// Saves the verdict of an image, replacing any entry of the same image.
+		//
+		static void store( entry&& e )
+		{
+			std::lock_guard _g{ lock };
+			std::erase_if( entries, [ & ] ( auto& o ) { return o.id.path == e.id.path && o.id.base == e.id.base; } );
+			if ( entries.size() >= capacity )
+				entries.clear();
+			entries.emplace_back( std::move( e ) );
+		}
+	};
+};
@@ -0,0 +1,278 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+
+// The Linux backend builds without the kernel libraries, it has no disassembler and relies on registered lengths.
+//
+#if defined( __linux__ )
+	#ifndef FORCE_INLINE
+		#define FORCE_INLINE __attribute__( ( always_inline ) )
+	#endif
+	#ifndef __cdecl
+		#define __cdecl
+	#endif
+#else
+	#include <ia32.hpp>
+	#include <ia32/hde64.hpp>
+#endif
+
+// Compact record of a delivered interrupt.
+//
+struct fault_record
+{
+	uint64_t tsc;           // TSC at ISR entry.
+	int32_t  rip_offset;    // Interrupted RIP relative to the counters' base.
+	uint16_t error_code;
+	uint8_t  vector;
+	uint8_t  flags;         // Bit 0 set if an error code was pushed.
+
+	bool has_error_code() const { return flags & 1; }
+	operator uint8_t() const { return vector; }
+};
+static_assert( sizeof( fault_record ) == 16 );
+
+// Basic interrupt handling logic.
+// - The ISR appends records until the buffer is full, further ones only increment the dropped counter.
+//
+struct interrupt_counters
+{
+	static constexpr size_t capacity = 32;
+
+	// Accessed by the ISR through GS, layout is fixed.
+	//
+	fault_record* iterator;
+	fault_record* limit;
+	uint64_t dropped = 0;
+	uint64_t rip_base;
+	interrupt_counters* self;
+
+	// Instruction length cache statistics of the faults skipped while bound, the nill counter keeps none.
+	//
+	uint64_t length_hits = 0;
+	uint64_t length_misses = 0;
+	fault_record store[ capacity ];
+
+	// Interrupt recording enabled, RIPs are recorded relative to the constructing function.
+	//
+	interrupt_counters()
+	{
+		iterator = &store[ 0 ];
+		limit = &store[ capacity ];
+		asm( "lea 0(%%rip), %0" : "=r" ( rip_base ) );
+		self = this;
+	}
+
+	// No counter recording.
+	//
+	interrupt_counters( std::nullopt_t )
+	{
+		iterator = nullptr;
+		limit = nullptr;
+		rip_base = 0;
+		self = nullptr;
+	}
+	interrupt_counters( const interrupt_counters& ) = delete;
+
+	// Make iterable.
+	//
+	auto* begin() const { return &store[ 0 ]; }
+	auto* end() const { return ( const fault_record* ) iterator; }
+	size_t size() const { return iterator ? end() - begin() : 0; }
+	void clear() { iterator = &store[ 0 ]; dropped = 0; }
+
+	// Resolves the absolute RIP of a record.
+	//
+	uint64_t rip_of( const fault_record& r ) const { return rip_base + r.rip_offset; }
+
+	// Simple check for exceptions.
+	// - Dropped records are counted as exceptions since their vector is unknown, overflowing the buffer can only
+	//   overstate the count, never hide one.
+	//
+	size_t count_exceptions() const
+	{
+		size_t n = dropped;
+		for ( auto it = begin(); it != end(); ++it )
+			n += *it != 2 && *it <= 0x1E;
+		return n;
+	}
+	bool has_exception() const
+	{
+		if ( dropped )
+			return true;
+		for ( auto it = begin(); it != end(); ++it )
+			if ( *it != 2 && *it <= 0x1E )
+				return true;
+		return false;
+	}
+};
+static_assert( offsetof( interrupt_counters, iterator ) == 0 );
+static_assert( offsetof( interrupt_counters, limit ) == 8 );
+static_assert( offsetof( interrupt_counters, dropped ) == 16 );
+static_assert( offsetof( interrupt_counters, rip_base ) == 24 );
+static_assert( offsetof( interrupt_counters, self ) == 32 );
+
+namespace impl
+{
+	// Checks whether or not the CPU pushes an error code for the vector.
+	//
+	inline constexpr bool pushes_error_code( uint8_t vector )
+	{
+		return vector == 8 ||  // #DF
+			   vector == 10 || // #TS
+			   vector == 11 || // #NP
+			   vector == 12 || // #SS
+			   vector == 13 || // #GP
+			   vector == 14 || // #PF
+			   vector == 17 || // #AC
+			   vector == 21 || // #CP
+			   vector == 30;   // #SX
+	}
+
+	// Checks whether or not the faulting instruction has to be skipped on return, traps resume after it already.
+	//
+	inline constexpr bool skips_instruction( uint8_t vector )
+	{
+		return vector != 1 /*cba, assume trap*/ &&
+			   vector != 2 /*NMI*/ &&
+			   vector != 3 /*trap*/ &&
+			   vector != 4 /*trap*/ &&
+			   vector <= 0x1E /*not exception otherwise*/;
+	}
+
+	// Direct-mapped cache of instruction lengths keyed by the faulting RIP.
+	// - Entries pack the canonical RIP in the upper 48 bits and the length in the lower 16, 0 is empty.
+	// - Racing writers can only replace an entry with another valid one, so no locking is needed.
+	//
+	struct length_cache
+	{
+		static constexpr size_t size = 256;
+		inline static std::array<std::atomic<uint64_t>, size> entries = {};
+
+		FORCE_INLINE static std::atomic<uint64_t>& slot( const void* ip )
+		{
+			uint64_t h = uint64_t( ip ) * 0x9E3779B97F4A7C15;
+			return entries[ h >> 56 ];
+		}
+		FORCE_INLINE static uint8_t lookup( const void* ip )
+		{
+			uint64_t e = slot( ip ).load( std::memory_order::relaxed );
+			if ( e && ( int64_t( e ) >> 16 ) == int64_t( ip ) )
+				return uint8_t( e );
+			return 0;
+		}
+		FORCE_INLINE static void insert( const void* ip, uint8_t length )
+		{
+			slot( ip ).store( ( uint64_t( ip ) << 16 ) | length, std::memory_order::relaxed );
+		}
+	};
+
+	// Probe sites registered by the probe:: wrappers, each inlined copy emits its own record.
+	//
+	struct probe_site
+	{
+		const void* ip;
+		uint64_t length;
+	};
+#if defined( __linux__ )
+	#define PROBE_SITE_SECTION "probe_sites, \"aw\""
+	extern "C" [[gnu::weak]] const probe_site __start_probe_sites[];
+	extern "C" [[gnu::weak]] const probe_site __stop_probe_sites[];
+	inline std::span<const probe_site> probe_sites() { return { __start_probe_sites, __stop_probe_sites }; }
+#else
+	#define PROBE_SITE_SECTION ".probes$m, \"dr\""
+	[[gnu::section( ".probes$a" ), gnu::used]] inline const probe_site probe_sites_begin = {};
+	[[gnu::section( ".probes$z" ), gnu::used]] inline const probe_site probe_sites_end = {};
+	inline std::span<const probe_site> probe_sites() { return { &probe_sites_begin + 1, &probe_sites_end }; }
+#endif
+
+	// Seeds the length cache with the registered probe sites, padding between the section contributions is skipped.
+	//
+	inline void register_probe_sites()
+	{
+		for ( auto& site : probe_sites() )
+			if ( site.ip )
+				length_cache::insert( site.ip, uint8_t( site.length ) );
+	}
+	[[gnu::constructor]] inline void __init_probe_sites() { register_probe_sites(); }
+
+	// Decodes the length of an instruction, 0 if unknown.
+	//
+	inline uint8_t decode_length( const void* ip )
+	{
+#if defined( __linux__ )
+		( void ) ip;
+		return 0;
+#else
+		auto hde = hde64::disasm( ip );
+		if ( hde.flags & F_ERROR_OPCODE )
+			return 15;
+		else
+			return hde.len;
+#endif
+	}
+
+	// Resolves the length of the faulting instruction, accounting the lookup to the bound counters.
+	//
+	FORCE_INLINE inline uint8_t instruction_length( const void* ip, interrupt_counters* ctrs )
+	{
+		uint8_t length = length_cache::lookup( ip );
+		if ( ctrs )
+			++( length ? ctrs->length_hits : ctrs->length_misses );
+		if ( !length && ( length = decode_length( ip ) ) )
+			length_cache::insert( ip, length );
+		return length;
+	}
+
+	// Skips a single instruction, called from the counter ISR.
+	//
+#if !defined( __linux__ )
+	[[gnu::no_caller_saved_registers]] inline void __cdecl skip_instruction( const void** ip, interrupt_counters* ctrs )
+	{
+		*ip = ( const uint8_t* ) *ip + instruction_length( *ip, ctrs );
+	}
+#endif
+};
+
+
+// Wrappers of the instructions probed in fault-heavy sweeps, each call site registers its length with the cache.
+// - Memory is clobbered so that the guard state is not reordered across the faulting instruction.
+//
+#define PROBE_SITE( length ) \
+	".pushsection " PROBE_SITE_SECTION "\n" \
+	".balign 8\n" \
+	".quad probe%=\n" \
+	".quad " #length "\n" \
+	".popsection\n"
+namespace probe
+{
+	FORCE_INLINE inline uint64_t read_msr( uint64_t id )
+	{
+		uint32_t lo, hi;
+		asm volatile( "probe%=: rdmsr\n" PROBE_SITE( 2 ) : "=a" ( lo ), "=d" ( hi ) : "c" ( id ) : "memory" );
+		return lo | ( uint64_t( hi ) << 32 );
+	}
+	FORCE_INLINE inline void write_msr( uint64_t id, uint64_t value )
+	{
+		asm volatile( "probe%=: wrmsr\n" PROBE_SITE( 2 ) :: "c" ( id ), "a" ( uint32_t( value ) ), "d" ( uint32_t( value >> 32 ) ) : "memory" );
+	}
+	FORCE_INLINE inline uint64_t read_xcr( uint64_t id )
+	{
+		uint32_t lo, hi;
+		asm volatile( "probe%=: xgetbv\n" PROBE_SITE( 3 ) : "=a" ( lo ), "=d" ( hi ) : "c" ( id ) : "memory" );
+		return lo | ( uint64_t( hi ) << 32 );
+	}
+	FORCE_INLINE inline void write_xcr( uint64_t id, uint64_t value )
+	{
+		asm volatile( "probe%=: xsetbv\n" PROBE_SITE( 3 ) :: "c" ( id ), "a" ( uint32_t( value ) ), "d" ( uint32_t( value >> 32 ) ) : "memory" );
+	}
+	FORCE_INLINE inline uint64_t read_pmc( uint64_t id )
+	{
+		uint32_t lo, hi;
+		asm volatile( "probe%=: rdpmc\n" PROBE_SITE( 2 ) : "=a" ( lo ), "=d" ( hi ) : "c" ( id ) : "memory" );
+		return lo | ( uint64_t( hi ) << 32 );
+	}
+};
\ No newline at end of file
@@ -2,134 +2,80 @@
 #include <ia32.hpp>
 #include <array>
 #include <optional>
-#include <ia32/hde64.hpp>
-
-// Basic interrupt handling logic.
-//
-struct interrupt_counters
-{
-	uint8_t* iterator;
-	uint8_t store[ 128 ];
-
-	// Interrupt recording enabled.
-	//
-	interrupt_counters()
-	{
-		iterator = &store[ 0 ];
-	}
-
-	// No counter recording.
-	//
-	interrupt_counters( std::nullopt_t )
-	{
-		iterator = nullptr;
-	}
-
-	// Make iterable.
-	//
-	auto* begin() const { return &store[ 0 ]; }
-	auto* end() const { return iterator; }
-	size_t size() const { return iterator ? end() - begin() : 0; }
-	void clear() { iterator = &store[ 0 ]; }
-
-	// Simple check for exceptions.
-	//
-	size_t count_exceptions() const
-	{
-		size_t n = 0;
-		for ( auto it = begin(); it != end(); ++it )
-			n += *it != 2 && *it <= 0x1E;
-		return n;
-	}
-	bool has_exception() const
-	{
-		for ( auto it = begin(); it != end(); ++it )
-			if ( *it != 2 && *it <= 0x1E )
-				return true;
-		return false;
-	}
-};
+#include "interrupt_counters.hpp"
 
 namespace impl
 {
 	static interrupt_counters nill_counter = { std::nullopt };
 
-	// Skips a single instruction.
-	//
-	[[gnu::no_caller_saved_registers]] inline void __cdecl skip_instruction( const void** ip )
-	{
-		if ( !memcmp( *ip, "\x0F\x01\xD1", 3 ) || !memcmp( *ip, "\x0F\x01\xD0", 3 ) )
-			*ip = xstd::ptr_at( *ip, 3 );
-		else
-		{
-			auto hde = hde64::disasm( *ip );
-			if ( hde.flags & F_ERROR_OPCODE )
-				*ip = xstd::ptr_at( *ip, 15 );
-			else
-				*ip = xstd::ptr_at( *ip, hde.len );
-		}
-	}
-
 	// The common interrupt service routine.
 	//
 	template<uint8_t vector>
 	[[gnu::naked, no_split]] inline void counter_isr()
 	{
-		static constexpr bool has_exception =
-			vector == 8 ||  // #DF
-			vector == 10 || // #TS
-			vector == 11 || // #NP
-			vector == 12 || // #SS
-			vector == 13 || // #GP
-			vector == 14 || // #PF
-			vector == 17 || // #AC
-			vector == 21 || // #CP
-			vector == 30;   // #SX
+		static constexpr bool has_exception = pushes_error_code( vector );
 		
 		// Nop padding for deferred #DB.
 		//
 		__asm { nop };
 
+		// Append a record if there is room, otherwise count it as dropped.
+		// - Stack after saving RAX, RDX and RCX: [rsp+24] is the error code if any, followed by the RIP.
+		// - Without an error code the RIP is read in its place and masked out.
+		//
+		asm volatile(
+			"push   %%rax\n"
+			"push   %%rdx\n"
+			"push   %%rcx\n"
+			"rdtsc\n"
+			"mov    %%gs:0, %%rcx\n"
+			"test   %%rcx, %%rcx\n"
+			"jz     2f\n"
+			"cmp    %%gs:8, %%rcx\n"
+			"jae    1f\n"
+			"shl    $32, %%rdx\n"
+			"or     %%rdx, %%rax\n"
+			"mov    %%rax, (%%rcx)\n"
+			"mov    %c[rip](%%rsp), %%rax\n"
+			"sub    %%gs:24, %%rax\n"
+			"mov    %%eax, 8(%%rcx)\n"
+			"mov    24(%%rsp), %%eax\n"
+			"and    %[mask], %%eax\n"
+			"mov    %%ax, 12(%%rcx)\n"
+			"movw   %[tag], 14(%%rcx)\n"
+			"addq   $16, %%gs:0\n"
+			"jmp    2f\n"
+		"1:\n"
+			"incq   %%gs:16\n"
+		"2:\n"
+			"pop    %%rcx\n"
+			"pop    %%rdx\n"
+			"pop    %%rax\n"
+			:: [rip] "i" ( has_exception ? 32 : 24 ),
+			   [mask] "i" ( has_exception ? 0xFFFF : 0 ),
+			   [tag] "i" ( vector | ( has_exception ? 0x100 : 0 ) )
+		);
+
 		// Pop exception code if relevant.
 		//
 		if constexpr ( has_exception )
 			__asm { add rsp, 8 };
 
-		// Handle the interrupt counter.
-		//
-		__asm 
-		{
-			push        rax
-			push        rbx
-		};
-		asm volatile( "mov %0, %%bl" :: "i" ( vector ) );
-		__asm
-		{
-			mov         rax,             gs:[0]
-			test        rax,             rax
-			jz          skip_counter
-
-			mov         [rax],           bl
-			inc         qword ptr gs:[0]
-
-		skip_counter:
-			pop         rbx
-			pop         rax
-		}
-
 		// Skip to the failure handler if exception, else continue.
+		// - The bound counters are passed through their self pointer, the extra slot keeps the stack aligned.
 		//
-		if constexpr ( vector != 1 /*cba, assume trap*/ && 
-					   vector != 2 /*NMI*/ &&
-					   vector != 3 /*trap*/ && 
-					   vector != 4 /*trap*/ && 
-					   vector <= 0x1E /*not exception otherwise*/ )
+		if constexpr ( skips_instruction( vector ) )
 		{
 			__asm 
 			{ 
 				push    rcx
-				lea     rcx,             [rsp+8]
+				push    rdx
+				sub     rsp,             8
+				lea     rcx,             [rsp+24]
+				mov     rdx,             qword ptr gs:[32]
 				call    skip_instruction
+				add     rsp,             8
+				pop     rdx
 				pop     rcx
 			}
 		}
@@ -199,3 +145,18 @@ struct interrupt_guard
 	~interrupt_guard() { end(); }
 };
 
+
+// Long-lived guard for batched probes.
+// - The IDT is installed once on entry, probes only retarget the counters with a GSBASE write.
+//
+struct interrupt_session : interrupt_guard
+{
+	using interrupt_guard::interrupt_guard;
+
+	// Redirects the interrupts of the following probes to the given counters.
+	//
+	FORCE_INLINE static void bind( interrupt_counters* counters = &impl::nill_counter )
+	{
+		ia32::write_gsbase( counters );
+	}
+};
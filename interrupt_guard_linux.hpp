@@ -0,0 +1,149 @@
+#pragma once
+#include <signal.h>
+#include <ucontext.h>
+#include <x86intrin.h>
+#include <optional>
+#include <utility>
+#include "interrupt_counters.hpp"
+
+// User-mode backend of interrupt_guard for Linux.
+// - Faults are delivered as signals, the kernel reports the original vector, error code and RIP in the machine
+//   context which are recorded with the same semantics as the counter ISR.
+// - Faulting instructions are skipped with the shared instruction length cache, traps resume after themselves. There
+//   is no disassembler in user mode, so only instructions of registered probe sites can be skipped.
+// - Signals raised outside of a guard or by an unknown instruction are chained to the disposition that was replaced.
+//
+namespace impl
+{
+	static interrupt_counters nill_counter = { std::nullopt };
+
+	// Counters of the current thread, the equivalent of GSBASE.
+	//
+	inline thread_local interrupt_counters* current_counters = nullptr;
+
+	// Dispositions replaced by the handlers, indexed by signal number.
+	//
+	inline constexpr int counter_signals[] = { SIGSEGV, SIGILL, SIGTRAP, SIGBUS, SIGFPE };
+	inline struct sigaction previous_actions[ NSIG ] = {};
+
+	// Hands a signal that is not ours to the disposition it replaced.
+	// - Default dispositions are restored and the signal raised again, which terminates the process as it would have.
+	//
+	inline void chain_signal( int sig, siginfo_t* info, void* context )
+	{
+		auto& prev = previous_actions[ sig ];
+		if ( prev.sa_flags & SA_SIGINFO )
+			return prev.sa_sigaction( sig, info, context );
+		if ( prev.sa_handler == SIG_IGN )
+			return;
+		if ( prev.sa_handler != SIG_DFL )
+			return prev.sa_handler( sig );
+		sigaction( sig, &prev, nullptr );
+		raise( sig );
+	}
+
+	// Signal handler standing in for counter_isr.
+	// - Faults outside of a guard, or whose instruction length is unknown, are not ours to skip.
+	//
+	inline void counter_signal( int sig, siginfo_t* info, void* context )
+	{
+		uint64_t tsc = __rdtsc();
+		auto& gregs = ( ( ucontext_t* ) context )->uc_mcontext.gregs;
+		uint8_t vector = uint8_t( gregs[ REG_TRAPNO ] );
+		auto* ctrs = current_counters;
+		if ( !ctrs )
+			return chain_signal( sig, info, context );
+
+		uint8_t length = 0;
+		if ( skips_instruction( vector ) )
+		{
+			length = instruction_length( ( const void* ) gregs[ REG_RIP ], ctrs->self );
+			if ( !length )
+				return chain_signal( sig, info, context );
+		}
+
+		if ( ctrs->iterator )
+		{
+			if ( ctrs->iterator < ctrs->limit )
+			{
+				*ctrs->iterator++ = {
+					.tsc = tsc,
+					.rip_offset = int32_t( uint64_t( gregs[ REG_RIP ] ) - ctrs->rip_base ),
+					.error_code = uint16_t( pushes_error_code( vector ) ? gregs[ REG_ERR ] : 0 ),
+					.vector = vector,
+					.flags = uint8_t( pushes_error_code( vector ) ? 1 : 0 ),
+				};
+			}
+			else
+			{
+				ctrs->dropped++;
+			}
+		}
+		gregs[ REG_RIP ] += length;
+	}
+
+	// Installs the signal handlers once per process, saving the dispositions they replace.
+	//
+	inline void install_counter_signals()
+	{
+		static const bool installed = [ ] ()
+		{
+			struct sigaction sa = {};
+			sa.sa_sigaction = &counter_signal;
+			sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+			sigemptyset( &sa.sa_mask );
+			for ( int sig : counter_signals )
+				sigaction( sig, &sa, &previous_actions[ sig ] );
+			return true;
+		}();
+		( void ) installed;
+	}
+};
+
+// RAII exception catching.
+//
+struct interrupt_guard
+{
+	interrupt_counters* previous = nullptr;
+	bool active = false;
+
+	// Starts guarding the scope from any faults.
+	//
+	interrupt_guard( interrupt_counters* counters = &impl::nill_counter ) { reset( counters ); }
+	void reset( interrupt_counters* counters )
+	{
+		if ( !active )
+		{
+			impl::install_counter_signals();
+			previous = std::exchange( impl::current_counters, counters );
+			active = true;
+		}
+	}
+
+	// No copy allowed.
+	//
+	interrupt_guard( const interrupt_guard& ) = delete;
+
+	// Exits the guarded scope on destruction.
+	//
+	void end()
+	{
+		if ( std::exchange( active, false ) )
+			impl::current_counters = previous;
+	}
+	~interrupt_guard() { end(); }
+};
+
+// Long-lived guard for batched probes.
+//
+struct interrupt_session : interrupt_guard
+{
+	using interrupt_guard::interrupt_guard;
+
+	// Redirects the faults of the following probes to the given counters.
+	//
+	FORCE_INLINE static void bind( interrupt_counters* counters = &impl::nill_counter )
+	{
+		impl::current_counters = counters;
+	}
+};
@@ -1,7 +1,14 @@
+#include <array>
+#include <algorithm>
+#include <atomic>
+#include <utility>
 #include <ia32/memory.hpp>
 #include <sdk/mi/api.hpp>
 #include <sdk/mm/api.hpp>
 #include <ntpp.hpp>
+#include <mcrt/interface.hpp>
+#include "timing.hpp"
+#include "upause.hpp"
 
 static any_ptr reserve_system_va( size_t length, mi::system_va_type_t type, bool use_ptes )
 {
@@ -39,18 +46,386 @@ FORCE_INLINE void ia32::mem::ipi_flush_tlb( any_ptr ptr, size_t length )
 {
 	ntpp::call_ipi( [ & ] { ia32::invlpg( ptr, length ); } );
 }
-FORCE_INLINE any_ptr ia32::mem::map_physical_memory_range( uint64_t address, size_t length, bool cached )
+
+// Spinlock held at DISPATCH_LEVEL so that a DPC cannot preempt the owner on the same processor.
+//
+struct dispatch_lock
 {
-	// Align parameters by large-page.
+	std::atomic<bool>& flag;
+	irql_t prev;
+	dispatch_lock( std::atomic<bool>& flag ) : flag( flag ), prev( ia32::get_irql() )
+	{
+		if ( prev < DISPATCH_LEVEL )
+			ia32::set_irql( DISPATCH_LEVEL );
+		while ( flag.exchange( true, std::memory_order::acquire ) )
+			yield_cpu();
+	}
+	~dispatch_lock()
+	{
+		flag.store( false, std::memory_order::release );
+		if ( prev < DISPATCH_LEVEL )
+			ia32::set_irql( prev );
+	}
+};
+
+// Deferred TLB shootdown of the unmapped ranges.
+// - Translations of an unmapped range may still be cached by any processor, so its VA is only returned to the OS
+//   once a shootdown covering it completed. VA obtained from the OS can thus never be cached and mapping it
+//   requires no invalidation at all.
+// - Ranges are queued and flushed in a single broadcast once the queue is full, VA runs out or the oldest one
+//   waited for longer than the age limit, adjacent ranges of the same page size are merged and each page is
+//   invalidated once.
+// - The release callbacks live in the image, so the queue is drained on rundown.
+//
+namespace shootdown
+{
+	struct range
+	{
+		any_ptr va = nullptr;
+		size_t length = 0;
+		size_t page = 0;
+		void( *release )( any_ptr, size_t ) = nullptr;
+	};
+	static constexpr size_t capacity = 16;
+	static std::array<range, capacity> pending = {};
+	static size_t count = 0;
+	static uint64_t oldest = 0; // TSC at which the first pending range was queued.
+	static std::atomic<bool> lock = false;
+	static constexpr auto age_limit = 10ms;
+
+	// Above this many pages a full flush is cheaper than individual invalidations.
 	//
-	uint64_t offset = address & ( page_size( pde_level ) - 1 );
-	address -= offset;
-	length += offset;
-	length = xstd::align_up( length, page_size( pde_level ) );
+	static constexpr size_t invlpg_limit = 32;
 
-	// Reserve system VA.
+	// Statistics.
 	//
-	auto va = reserve_system_va( length, mi::system_va_type_t::system_ptes, false );
+	static std::atomic<uint64_t> broadcasts = 0;
+	static std::atomic<uint64_t> skipped = 0;
+	static std::atomic<uint64_t> deferred = 0;
+
+	// Invalidates the batch on every processor and releases the VA.
+	//
+	static void flush( std::array<range, capacity>& batch, size_t n )
+	{
+		if ( !n )
+			return;
+		std::sort( batch.begin(), batch.begin() + n, [ ] ( auto& a, auto& b ) { return a.va < b.va; } );
+
+		// Merge adjacent ranges.
+		//
+		std::array<range, capacity> merged = {};
+		size_t m = 0, pages = 0;
+		for ( size_t i = 0; i != n; i++ )
+		{
+			auto& last = merged[ m ? m - 1 : 0 ];
+			if ( m && last.page == batch[ i ].page && ( last.va + last.length ) == batch[ i ].va )
+				last.length += batch[ i ].length;
+			else
+				merged[ m++ ] = batch[ i ];
+			pages += batch[ i ].length / batch[ i ].page;
+		}
+
+		// Invalidate.
+		//
+		if ( pages > invlpg_limit )
+		{
+			ia32::mem::ipi_flush_tlb();
+		}
+		else
+		{
+			ntpp::call_ipi( [ & ]
+			{
+				for ( size_t i = 0; i != m; i++ )
+					for ( size_t it = 0; it < merged[ i ].length; it += merged[ i ].page )
+						ia32::invlpg( merged[ i ].va + it );
+			} );
+		}
+		broadcasts++;
+
+		// Release the VA.
+		//
+		for ( size_t i = 0; i != n; i++ )
+			batch[ i ].release( batch[ i ].va, batch[ i ].length );
+	}
+
+	// Number of pending ranges.
+	//
+	static size_t pending_count()
+	{
+		dispatch_lock _l{ lock };
+		return count;
+	}
+
+	// Flushes every pending range, returns whether or not there were any.
+	//
+	static bool drain()
+	{
+		std::array<range, capacity> batch;
+		size_t n;
+		{
+			dispatch_lock _l{ lock };
+			batch = pending;
+			n = std::exchange( count, 0 );
+		}
+		flush( batch, n );
+		return n != 0;
+	}
+
+	// Flushes every pending range if the oldest one is past the age limit.
+	//
+	static void expire()
+	{
+		std::array<range, capacity> batch;
+		size_t n = 0;
+		{
+			dispatch_lock _l{ lock };
+			if ( count && ( ia32::read_tsc() - oldest ) > crt::to_cycles( age_limit ) )
+			{
+				batch = pending;
+				n = std::exchange( count, 0 );
+			}
+		}
+		flush( batch, n );
+	}
+
+	// Queues an unmapped range, flushing the queue if full or stale.
+	//
+	static void defer( any_ptr va, size_t length, size_t page, void( *release )( any_ptr, size_t ) )
+	{
+		std::array<range, capacity> batch;
+		size_t n = 0;
+		{
+			dispatch_lock _l{ lock };
+			deferred++;
+			uint64_t tnow = ia32::read_tsc();
+			if ( count == capacity || ( count && ( tnow - oldest ) > crt::to_cycles( age_limit ) ) )
+			{
+				batch = pending;
+				n = std::exchange( count, 0 );
+			}
+			if ( !count )
+				oldest = tnow;
+			pending[ count++ ] = { va, length, page, release };
+		}
+		flush( batch, n );
+	}
+};
+
+// Drains the pending shootdowns on rundown, after the mapping cache was unmapped.
+//
+[[gnu::destructor( 111 )]] void __rundown_shootdowns()
+{
+	shootdown::drain();
+}
+
+// Window of 4 KB slots reserved at init for small mappings.
+// - A single large page worth of VA with its own page table, slots are allocated as runs within a bitmap word and
+//   processors start their search at different words to avoid contending on the same one.
+// - Mapping a slot is allocation free, slots are released into the bitmap after their shootdown.
+//
+namespace window
+{
+	static constexpr size_t slot_count = 512;
+	static constexpr size_t max_run = 16;
+	static any_ptr base = nullptr;
+	static std::array<std::atomic<uint64_t>, slot_count / 64> bitmap = {};
+
+	// Statistics.
+	//
+	static std::atomic<uint64_t> allocations = 0;
+	static std::atomic<uint64_t> exhausted = 0;
+
+	// Checks whether or not the address belongs to the window.
+	//
+	static bool contains( any_ptr va )
+	{
+		return base && base <= va && va < ( base + slot_count * ia32::mem::page_size( ia32::mem::pte_level ) );
+	}
+
+	// Allocates a run of slots, returns null if there is none left.
+	//
+	static any_ptr allocate( size_t pages )
+	{
+		if ( !base || !pages || pages > max_run )
+			return nullptr;
+		uint64_t mask = ( 1ull << pages ) - 1;
+		size_t start = nt::read_pcid();
+		for ( size_t w = 0; w != bitmap.size(); w++ )
+		{
+			size_t word = ( start + w ) % bitmap.size();
+			uint64_t cur = bitmap[ word ].load();
+			for ( size_t bit = 0; bit + pages <= 64; )
+			{
+				if ( cur & ( mask << bit ) )
+				{
+					bit++;
+					continue;
+				}
+				if ( bitmap[ word ].compare_exchange_weak( cur, cur | ( mask << bit ) ) )
+				{
+					allocations++;
+					return base + ( word * 64 + bit ) * ia32::mem::page_size( ia32::mem::pte_level );
+				}
+				bit = 0;
+			}
+		}
+		exhausted++;
+		return nullptr;
+	}
+
+	// Releases the slots of the range.
+	//
+	static void release( any_ptr va, size_t length )
+	{
+		size_t slot = ( va - base ) / ia32::mem::page_size( ia32::mem::pte_level );
+		size_t pages = length / ia32::mem::page_size( ia32::mem::pte_level );
+		bitmap[ slot / 64 ] &= ~( ( ( 1ull << pages ) - 1 ) << ( slot % 64 ) );
+	}
+};
+
+// Pool of large page slots reserved at init.
+// - Free slots form a lock-free stack threaded through the next array, the head packs a tag incremented on every
+//   update with the index + 1 of the top slot so that a concurrent pop and push cannot be mistaken for no change.
+// - Only single slot mappings are served, longer ones and overflow go through the OS.
+//
+namespace pool
+{
+	static constexpr size_t slot_count = 64;
+	static any_ptr base = nullptr;
+	static std::atomic<uint64_t> head = 0;
+	static std::array<std::atomic<uint32_t>, slot_count> next = {};
+
+	// Statistics.
+	//
+	static std::atomic<uint64_t> in_use = 0;
+	static std::atomic<uint64_t> high_water = 0;
+	static std::atomic<uint64_t> fallbacks = 0;
+
+	// Checks whether or not the address belongs to the pool.
+	//
+	static bool contains( any_ptr va )
+	{
+		return base && base <= va && va < ( base + slot_count * ia32::mem::page_size( ia32::mem::pde_level ) );
+	}
+
+	// Pushes a slot onto the free stack.
+	//
+	static void push( uint32_t slot )
+	{
+		uint64_t h = head.load();
+		do
+			next[ slot ] = uint32_t( h );
+		while ( !head.compare_exchange_weak( h, ( ( h >> 32 ) + 1 ) << 32 | ( slot + 1 ) ) );
+	}
+
+	// Pops a slot, returns null if there is none left.
+	//
+	static any_ptr allocate()
+	{
+		uint64_t h = head.load();
+		while ( uint32_t top = uint32_t( h ) )
+		{
+			if ( head.compare_exchange_weak( h, ( ( h >> 32 ) + 1 ) << 32 | next[ top - 1 ].load() ) )
+			{
+				uint64_t n = ++in_use;
+				uint64_t prev = high_water.load();
+				while ( prev < n && !high_water.compare_exchange_weak( prev, n ) );
+				return base + ( top - 1 ) * ia32::mem::page_size( ia32::mem::pde_level );
+			}
+		}
+		return nullptr;
+	}
+	static void release( any_ptr va, size_t length )
+	{
+		push( uint32_t( ( va - base ) / ia32::mem::page_size( ia32::mem::pde_level ) ) );
+		--in_use;
+	}
+};
+
+// Reserves the window and the pool.
+//
+[[gnu::constructor( 111 )]] void __init_va()
+{
+	window::base = reserve_system_va( window::slot_count * ia32::mem::page_size( ia32::mem::pte_level ), mi::system_va_type_t::system_ptes, true );
+	pool::base = reserve_system_va( pool::slot_count * ia32::mem::page_size( ia32::mem::pde_level ), mi::system_va_type_t::system_ptes, false );
+	if ( pool::base )
+	{
+		for ( size_t i = pool::slot_count; i != 0; i-- )
+			pool::push( uint32_t( i - 1 ) );
+	}
+}
+
+// Returns the window and the pool on rundown, once the mappings were unmapped and the shootdowns releasing their
+// slots drained.
+//
+[[gnu::destructor( 110 )]] void __rundown_va()
+{
+	shootdown::drain();
+	if ( window::base )
+		return_system_va( std::exchange( window::base, nullptr ), window::slot_count * ia32::mem::page_size( ia32::mem::pte_level ), mi::system_va_type_t::system_ptes );
+	if ( pool::base )
+		return_system_va( std::exchange( pool::base, nullptr ), pool::slot_count * ia32::mem::page_size( ia32::mem::pde_level ), mi::system_va_type_t::system_ptes );
+}
+
+// Maps a page aligned physical range into window slots, returns null if the window is full.
+//
+static any_ptr map_small_pages( uint64_t address, size_t length, bool cached )
+{
+	using namespace ia32::mem;
+
+	// If the window is full, release the slots pending a shootdown and retry.
+	//
+	auto va = window::allocate( length / page_size( pte_level ) );
+	if ( !va && shootdown::drain() )
+		va = window::allocate( length / page_size( pte_level ) );
+	if ( !va ) return nullptr;
+	for ( size_t it = 0; it < length; it += page_size( pte_level ) )
+	{
+		ia32::pt_entry_64 pte = { .flags = 0 };
+		pte.present = true;
+		pte.write = true;
+		pte.user = false;
+		pte.page_level_write_through = !cached;
+		pte.page_level_cache_disable = !cached;
+		pte.global = true;
+		pte.page_frame_number = ( address + it ) >> 12;
+		pte.execute_disable = false;
+		*get_pte( va + it, pte_level ) = pte;
+	}
+	shootdown::skipped++;
+	return va;
+}
+static void unmap_small_pages( any_ptr va, size_t length )
+{
+	using namespace ia32::mem;
+	for ( size_t it = 0; it < length; it += page_size( pte_level ) )
+		get_pte( va + it, pte_level )->flags = 0;
+	shootdown::defer( va, length, page_size( pte_level ), window::release );
+}
+
+// Maps a large-page aligned physical range into fresh system VA.
+// - The VA was never mapped since its last shootdown so no invalidation is needed.
+//
+static any_ptr map_large_pages( uint64_t address, size_t length, bool cached )
+{
+	using namespace ia32::mem;
+
+	// Take a slot from the pool if it fits in one, otherwise reserve system VA. If there is none left release the
+	// pending ranges and retry.
+	//
+	auto reserve = [ & ] () -> any_ptr
+	{
+		if ( length == page_size( pde_level ) )
+		{
+			if ( auto va = pool::allocate() )
+				return va;
+			pool::fallbacks++;
+		}
+		return reserve_system_va( length, mi::system_va_type_t::system_ptes, false );
+	};
+	auto va = reserve();
+	if ( !va && shootdown::drain() )
+		va = reserve();
 	if ( !va ) return nullptr;
 
 	// Map the pages.
@@ -72,24 +447,329 @@ FORCE_INLINE any_ptr ia32::mem::map_physical_memory_range( uint64_t address, siz
 		pte.execute_disable = false;
 		*get_pte( va + it, pde_level ) = pte;
 	}
+	shootdown::skipped++;
+	return va;
+}
+static void unmap_large_pages( any_ptr va, size_t length )
+{
+	using namespace ia32::mem;
+	for ( size_t it = 0; it < length; it += page_size( pde_level ) )
+		get_pte( va + it, pde_level )->flags = 0;
+	shootdown::defer( va, length, page_size( pde_level ), [ ] ( any_ptr va, size_t length )
+	{
+		if ( pool::contains( va ) )
+			pool::release( va, length );
+		else
+			return_system_va( va, length, mi::system_va_type_t::system_ptes );
+	} );
+}
+
+// Unmaps a page aligned range of either kind.
+//
+static void unmap_pages( any_ptr va, size_t length )
+{
+	if ( window::contains( va ) )
+		unmap_small_pages( va, length );
+	else
+		unmap_large_pages( va, length );
+}
+
+// Reference-counted cache of the physical mappings.
+// - Mappings are kept after their last reference is dropped and reused by any request they cover with the same
+//   cache attribute, the least recently used unreferenced entry is evicted when the cache is full.
+// - Unreferenced entries idle for longer than the limit are unmapped by the next map or unmap call, every entry is
+//   unmapped on rundown.
+// - If every entry is referenced the mapping bypasses the cache.
+// - Entries may be of either page size, a large mapping also serves the small ranges it covers.
+// - Page tables are only edited outside of the lock.
+//
+namespace mapping_cache
+{
+	struct entry
+	{
+		uint64_t phys = 0;
+		size_t length = 0;
+		any_ptr va = nullptr;
+		bool cached = false;
+		uint32_t refs = 0;
+		uint64_t last_use = 0;
+		uint64_t idle_since = 0; // TSC at which the last reference was dropped.
+	};
+	static constexpr size_t capacity = 32;
+	static constexpr auto idle_limit = 250ms;
+	static std::array<entry, capacity> entries = {};
+	static std::atomic<bool> lock = false;
+	static uint64_t clock = 0;
+
+	// Statistics.
+	//
+	static uint64_t hits = 0;
+	static uint64_t misses = 0;
+	static uint64_t evictions = 0;
+	static uint64_t expirations = 0;
+	static uint64_t bypasses = 0;
+
+	// Finds the entry covering the range, or the entry containing the virtual address.
+	//
+	static entry* find( uint64_t address, size_t length, bool cached )
+	{
+		for ( auto& e : entries )
+			if ( e.va && e.cached == cached && e.phys <= address && ( address + length ) <= ( e.phys + e.length ) )
+				return &e;
+		return nullptr;
+	}
+	static entry* find( any_ptr va )
+	{
+		for ( auto& e : entries )
+			if ( e.va && e.va <= va && va < ( e.va + e.length ) )
+				return &e;
+		return nullptr;
+	}
+
+	// Finds a free slot, if there is none the least recently used unreferenced entry is detached into victim.
+	//
+	static entry* allocate( entry& victim )
+	{
+		entry* lru = nullptr;
+		for ( auto& e : entries )
+		{
+			if ( !e.va )
+				return &e;
+			if ( !e.refs && ( !lru || e.last_use < lru->last_use ) )
+				lru = &e;
+		}
+		if ( lru )
+		{
+			victim = std::exchange( *lru, entry{} );
+			evictions++;
+		}
+		return lru;
+	}
+
+	// Detaches the unreferenced entries idle for longer than the limit into victims, returns their count.
+	//
+	static size_t detach_idle( std::array<entry, capacity>& victims )
+	{
+		uint64_t tnow = ia32::read_tsc();
+		uint64_t limit = crt::to_cycles( idle_limit );
+		size_t n = 0;
+		for ( auto& e : entries )
+		{
+			if ( e.va && !e.refs && ( tnow - e.idle_since ) > limit )
+			{
+				victims[ n++ ] = std::exchange( e, entry{} );
+				expirations++;
+			}
+		}
+		return n;
+	}
+
+	// Detaches unreferenced entries of the window in LRU order until at least the given length is freed, returns their count.
+	//
+	static size_t detach_window( std::array<entry, capacity>& victims, size_t length )
+	{
+		size_t n = 0, freed = 0;
+		while ( freed < length )
+		{
+			entry* lru = nullptr;
+			for ( auto& e : entries )
+				if ( e.va && !e.refs && window::contains( e.va ) && ( !lru || e.last_use < lru->last_use ) )
+					lru = &e;
+			if ( !lru )
+				break;
+			freed += lru->length;
+			victims[ n++ ] = std::exchange( *lru, entry{} );
+			evictions++;
+		}
+		return n;
+	}
+
+	// Unmaps the detached entries, called outside of the lock.
+	//
+	static void unmap( std::array<entry, capacity>& victims, size_t n )
+	{
+		for ( size_t i = 0; i != n; i++ )
+			unmap_pages( victims[ i ].va, victims[ i ].length );
+	}
+};
+
+// Unmaps every cached mapping on rundown, referenced ones included as their holders are gone with the image.
+//
+[[gnu::destructor( 112 )]] void __rundown_mappings()
+{
+	std::array<mapping_cache::entry, mapping_cache::capacity> victims = {};
+	size_t n = 0;
+	{
+		dispatch_lock _l{ mapping_cache::lock };
+		for ( auto& e : mapping_cache::entries )
+			if ( e.va )
+				victims[ n++ ] = std::exchange( e, mapping_cache::entry{} );
+	}
+	mapping_cache::unmap( victims, n );
+}
+
+// Exports the mapping cache statistics.
+//
+extern "C" [[gnu::dllexport]] transport::packet* memStatistics()
+{
+	cbor::instance result = {};
+	auto& mem = result[ "data" ][ "mem" ].object();
+
+	dispatch_lock _l{ mapping_cache::lock };
+	size_t mapped = 0, referenced = 0;
+	for ( auto& e : mapping_cache::entries )
+	{
+		mapped += e.va != nullptr;
+		referenced += e.refs != 0;
+	}
+	mem[ "capacity" ] = mapping_cache::capacity;
+	mem[ "mapped" ] = mapped;
+	mem[ "referenced" ] = referenced;
+	mem[ "hits" ] = mapping_cache::hits;
+	mem[ "misses" ] = mapping_cache::misses;
+	mem[ "evictions" ] = mapping_cache::evictions;
+	mem[ "expirations" ] = mapping_cache::expirations;
+	mem[ "bypasses" ] = mapping_cache::bypasses;
+	mem[ "shootdowns" ] = shootdown::broadcasts.load();
+	mem[ "shootdownsSkipped" ] = shootdown::skipped.load();
+	mem[ "shootdownsDeferred" ] = shootdown::deferred.load();
+	mem[ "shootdownsPending" ] = shootdown::pending_count();
+	mem[ "windowAllocations" ] = window::allocations.load();
+	mem[ "windowExhausted" ] = window::exhausted.load();
+	mem[ "poolSlots" ] = pool::base ? pool::slot_count : 0;
+	mem[ "poolInUse" ] = pool::in_use.load();
+	mem[ "poolHighWater" ] = pool::high_water.load();
+	mem[ "poolFallbacks" ] = pool::fallbacks.load();
+	return transport::serialize( result );
+}
+
+// Exports the statistics of the monitored waits, latencies are averaged over their samples.
+//
+extern "C" [[gnu::dllexport]] transport::packet* waitStatistics()
+{
+	cbor::instance result = {};
+	auto& wait = result[ "data" ][ "wait" ].object();
+	auto& s = util::wait_stats;
+	auto average = [ ] ( uint64_t total, uint64_t count ) { return count ? timing::to_ns( total / count ) : 0; };
+	wait[ "waits" ] = s.waits.load();
+	wait[ "wakes" ] = s.wakes.load();
+	wait[ "timeouts" ] = s.timeouts.load();
+	wait[ "latencySamples" ] = s.latency_samples.load();
+	wait[ "latencyAvgNs" ] = average( s.total_latency.load(), s.latency_samples.load() );
+	wait[ "latencyMaxNs" ] = timing::to_ns( s.max_latency.load() );
+	wait[ "windowAvgNs" ] = average( s.total_window.load(), s.wakes.load() );
+	wait[ "windowMaxNs" ] = timing::to_ns( s.max_window.load() );
+	wait[ "issueSamples" ] = s.issue_samples.load();
+	wait[ "issueLatencyAvgNs" ] = average( s.total_issue_latency.load(), s.issue_samples.load() );
+	wait[ "issueLatencyMaxNs" ] = timing::to_ns( s.max_issue_latency.load() );
+	return transport::serialize( result );
+}
+
+FORCE_INLINE any_ptr ia32::mem::map_physical_memory_range( uint64_t address, size_t length, bool cached )
+{
+	// Align parameters by the page size, small ranges are mapped with 4 KB pages from the window.
+	//
+	uint64_t offset, base;
+	size_t span;
+	auto align = [ & ] ( size_t page )
+	{
+		offset = address & ( page - 1 );
+		base = address - offset;
+		span = xstd::align_up( length + offset, page );
+	};
+	align( page_size( pte_level ) );
+	bool small = span <= window::max_run * page_size( pte_level );
+	if ( !small )
+		align( page_size( pde_level ) );
+
+	// Reuse an existing mapping if one covers the range, expire the idle ones otherwise.
+	//
+	std::array<mapping_cache::entry, mapping_cache::capacity> expired;
+	size_t num_expired;
+	{
+		dispatch_lock _l{ mapping_cache::lock };
+		if ( auto* e = mapping_cache::find( base, span, cached ) )
+		{
+			e->refs++;
+			e->last_use = ++mapping_cache::clock;
+			mapping_cache::hits++;
+			return e->va + ( base - e->phys ) + offset;
+		}
+		mapping_cache::misses++;
+		num_expired = mapping_cache::detach_idle( expired );
+	}
+	mapping_cache::unmap( expired, num_expired );
+	shootdown::expire();
+
+	// Create a new mapping. If the window is full, evict unreferenced small entries to make room and only fall back to
+	// large pages if that does not free a long enough run either.
+	//
+	any_ptr va = small ? map_small_pages( base, span, cached ) : nullptr;
+	if ( small && !va )
+	{
+		std::array<mapping_cache::entry, mapping_cache::capacity> victims;
+		size_t num_victims;
+		{
+			dispatch_lock _l{ mapping_cache::lock };
+			num_victims = mapping_cache::detach_window( victims, span );
+		}
+		if ( num_victims )
+		{
+			mapping_cache::unmap( victims, num_victims );
+			va = map_small_pages( base, span, cached );
+		}
+	}
+	if ( !va )
+	{
+		align( page_size( pde_level ) );
+		va = map_large_pages( base, span, cached );
+	}
+	if ( !va ) return nullptr;
 
-	// Invalidate the TLB, return the pointer.
+	// Insert it into the cache if there is room, unmap the evicted entry if any.
 	//
-	ipi_flush_tlb( va, length );
+	mapping_cache::entry victim = {};
+	{
+		dispatch_lock _l{ mapping_cache::lock };
+		if ( auto* e = mapping_cache::allocate( victim ) )
+			*e = { base, span, va, cached, 1, ++mapping_cache::clock };
+		else
+			mapping_cache::bypasses++;
+	}
+	if ( victim.va )
+		unmap_pages( victim.va, victim.length );
 	return va + offset;
 }
 FORCE_INLINE void ia32::mem::unmap_physical_memory_range( any_ptr va, size_t length ) 
 {
-	// Align parameters by large-page.
+	// Drop the reference if cached, the mapping is kept for reuse until it expires.
 	//
-	uint64_t offset = va & ( page_size( pde_level ) - 1 );
+	std::array<mapping_cache::entry, mapping_cache::capacity> expired;
+	size_t num_expired;
+	bool is_cached = false;
+	{
+		dispatch_lock _l{ mapping_cache::lock };
+		if ( auto* e = mapping_cache::find( va ) )
+		{
+			if ( !--e->refs )
+				e->idle_since = ia32::read_tsc();
+			is_cached = true;
+		}
+		num_expired = mapping_cache::detach_idle( expired );
+	}
+	mapping_cache::unmap( expired, num_expired );
+	if ( is_cached )
+		return;
+
+	// Align parameters by the page size of the mapping.
+	//
+	size_t page = window::contains( va ) ? page_size( pte_level ) : page_size( pde_level );
+	uint64_t offset = va & ( page - 1 );
 	va -= offset;
 	length += offset;
-	length = xstd::align_up( length, page_size( pde_level ) );
+	length = xstd::align_up( length, page );
 
 	// Unmap the pages.
 	//
-	for ( size_t it = 0; it < length; it += page_size( pde_level ) )
-		get_pte( va + it, pde_level )->flags = 0;
-	return_system_va( va, length, mi::system_va_type_t::system_ptes );
+	unmap_pages( va, length );
 }
\ No newline at end of file
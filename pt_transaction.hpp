@@ -0,0 +1,175 @@
+#pragma once
+#include <bit>
+#include <vector>
+#include <algorithm>
+#include <ia32.hpp>
+#include <ia32/memory.hpp>
+
+// Batched edit of the execute-disable bits of the current page tables.
+// - Edits are staged by walking the tables ahead of time, entries shared across ranges are deduplicated so that each
+//   one is only touched once and the last request wins.
+// - Commit applies every staged edit and invalidates once, rollback reverts exactly what commit changed.
+// - Storage is reserved at a lower IRQL, staging never allocates: callers size it from the ranges they will stage with
+//   entries_for. If it still runs out the transaction is marked as overflown, refuses to commit and reports the count
+//   needed so the caller can reserve more for the next one.
+//
+struct pt_transaction
+{
+	// Above this many changed translations a full flush is cheaper than individual invalidations.
+	//
+	static constexpr size_t invlpg_limit = 32;
+
+	struct edit
+	{
+		ia32::pt_entry_64* entry;
+		any_ptr            va;       // Set for leaf entries only.
+		bool               xd;
+		bool               applied;
+	};
+
+	std::vector<edit> log = {};
+	std::vector<uint32_t> index = {};  // Open-addressed set of log positions + 1, keyed by the entry address.
+	size_t needed = 0;
+	bool overflow = false;
+
+	// Upper bound of the entries staged for a range of the given length, every page it may span plus with rec the
+	// directories above each of them, before deduplication.
+	//
+	static constexpr size_t entries_for( size_t length, bool rec )
+	{
+		size_t pages = ( length + 0xFFF ) / 0x1000 + 1;
+		return pages * ( rec ? 4 : 1 );
+	}
+
+	// Reserves room for n entries, only valid at or below DISPATCH_LEVEL.
+	//
+	void reserve( size_t n )
+	{
+		log.clear();
+		log.reserve( n );
+		index.assign( std::bit_ceil( n * 2 ), 0 );
+		needed = 0;
+		overflow = false;
+	}
+
+	// Finds the log entry of the page table entry, inserting it if missing.
+	//
+	edit* lookup( ia32::pt_entry_64* e )
+	{
+		needed++;
+		size_t mask = index.size() - 1;
+		size_t i = ( size_t( e ) >> 3 ) * 0x9E3779B97F4A7C15 >> 32;
+		for ( size_t probe = 0; probe != index.size(); probe++, i++ )
+		{
+			auto& slot = index[ i & mask ];
+			if ( !slot )
+			{
+				if ( log.size() == log.capacity() )
+					break;
+				log.push_back( { e, nullptr, false, false } );
+				slot = uint32_t( log.size() );
+				return &log.back();
+			}
+			if ( log[ slot - 1 ].entry == e )
+			{
+				needed--;
+				return &log[ slot - 1 ];
+			}
+		}
+		overflow = true;
+		return nullptr;
+	}
+
+	// Stages the execute-disable state of the range, if rec is set the parent directories are staged as well.
+	//
+	bool set_nx( any_ptr p, int64_t n, bool xd, bool rec )
+	{
+		while ( n > 0 )
+		{
+			__hint_unroll()
+			for ( int8_t d = ia32::mem::pxe_level; d >= ia32::mem::pte_level; d-- )
+			{
+				auto e = ia32::mem::get_pte( p, d );
+
+				// If present:
+				if ( e->present )
+				{
+					bool leaf = d == ia32::mem::pte_level || e->large_page;
+					if ( leaf || rec )
+					{
+						if ( auto* entry = lookup( e ) )
+						{
+							entry->xd = xd;
+							if ( leaf )
+								entry->va = p;
+						}
+					}
+
+					// If not PTE and not large page, move to next level.
+					if ( !leaf )
+						continue;
+				}
+
+				// Onto the next one.
+				p += ia32::mem::page_size( d );
+				n -= ia32::mem::page_size( d );
+				break;
+			}
+		}
+		return !overflow;
+	}
+
+	// Invalidates the translations of the applied entries.
+	// - A changed directory entry affects every translation below it, so any such change takes a full flush.
+	//
+	void invalidate( size_t changed )
+	{
+		if ( !changed )
+			return;
+		bool directory = std::any_of( log.begin(), log.end(), [ ] ( auto& e ) { return e.applied && !e.va; } );
+		if ( directory || changed > invlpg_limit )
+			return ia32::flush_tlb();
+		for ( auto& e : log )
+			if ( e.applied )
+				ia32::invlpg( e.va );
+	}
+
+	// Applies the staged edits.
+	//
+	bool commit()
+	{
+		if ( overflow )
+			return false;
+		size_t changed = 0;
+		for ( auto& e : log )
+		{
+			if ( e.xd )
+				e.applied = !xstd::atomic_bit_set( e.entry->flags, PT_ENTRY_64_EXECUTE_DISABLE_BIT );
+			else
+				e.applied = xstd::atomic_bit_reset( e.entry->flags, PT_ENTRY_64_EXECUTE_DISABLE_BIT );
+			changed += e.applied;
+		}
+		invalidate( changed );
+		return true;
+	}
+
+	// Reverts the edits made by commit and clears the transaction.
+	//
+	void rollback()
+	{
+		size_t changed = 0;
+		for ( auto& e : log )
+		{
+			if ( !e.applied )
+				continue;
+			if ( e.xd )
+				xstd::atomic_bit_reset( e.entry->flags, PT_ENTRY_64_EXECUTE_DISABLE_BIT );
+			else
+				xstd::atomic_bit_set( e.entry->flags, PT_ENTRY_64_EXECUTE_DISABLE_BIT );
+			changed++;
+		}
+		invalidate( changed );
+		log.clear();
+		std::fill( index.begin(), index.end(), 0 );
+	}
+};
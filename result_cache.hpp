@@ -0,0 +1,86 @@
+#pragma once
+#include <array>
+#include <mutex>
+#include <ia32.hpp>
+#include <ntpp.hpp>
+#include <xstd/hashable.hpp>
+#include <xstd/spinlock.hpp>
+#include "interrupt_guard.hpp"
+
+namespace detection
+{
+	// Per-boot cache of the results of boot-invariant tests, indexed by registry position.
+	// - Entries are only valid for the processor fingerprint they were collected with.
+	// - Slots are locked for the copies since concurrent calls may load and store the same test, callers are at
+	//   DISPATCH_LEVEL or above so a holder is never preempted.
+	//
+	struct result_cache
+	{
+		static constexpr size_t capacity = 64;
+
+		struct slot
+		{
+			xstd::spinlock lock = {};
+			bool valid = false;
+			uint64_t fingerprint = 0;
+			cbor::object_t result = {};
+			cbor::object_t detections = {};
+		};
+		inline static std::array<slot, capacity> slots = {};
+
+		// Hashes the vendor, signature and microcode revision of the current processor.
+		// - Intel reports the revision in the high half of IA32_BIOS_SIGN_ID once it is cleared and CPUID executed, AMD
+		//   reports the patch level in the low half of the same MSR without the need of a write.
+		//
+		static uint64_t fingerprint()
+		{
+			uint64_t microcode = 0;
+			{
+				interrupt_counters ctrs = {};
+				interrupt_guard _g{ &ctrs };
+				if ( ia32::is_intel() )
+				{
+					ia32::write_msr( IA32_BIOS_SIGN_ID, 0 );
+					ia32::query_cpuid( 1 );
+					microcode = ia32::read_msr( IA32_BIOS_SIGN_ID ) >> 32;
+				}
+				else
+				{
+					microcode = uint32_t( ia32::read_msr( IA32_BIOS_SIGN_ID ) );
+				}
+			}
+			auto& vendor = ia32::static_cpuid<0, 0>;
+			auto& signature = ia32::static_cpuid<1, 0>;
+			return xstd::make_hash<xstd::fnv64>( vendor[ 1 ], vendor[ 2 ], vendor[ 3 ], signature[ 0 ], microcode ).as64();
+		}
+
+		// Copies the cached results of a test if valid for the fingerprint.
+		//
+		static bool load( size_t index, uint64_t fingerprint, cbor::object_t& result, cbor::object_t& detections )
+		{
+			if ( index >= capacity )
+				return false;
+			auto& s = slots[ index ];
+			std::lock_guard _g{ s.lock };
+			if ( !s.valid || s.fingerprint != fingerprint )
+				return false;
+			result = s.result;
+			detections = s.detections;
+			return true;
+		}
+
+		// Saves the results of a test.
+		//
+		static void store( size_t index, uint64_t fingerprint, const cbor::object_t& result, const cbor::object_t& detections )
+		{
+			if ( index >= capacity )
+				return;
+			auto& s = slots[ index ];
+			std::lock_guard _g{ s.lock };
+			s.fingerprint = fingerprint;
+			s.result = result;
+			s.detections = detections;
+			s.valid = true;
+		}
+	};
+};
@@ -0,0 +1,464 @@
+#pragma once
+#include <bit>
+#include <atomic>
+#include <array>
+#include <ia32.hpp>
+#include <ntpp.hpp>
+#include <sdk/ke/api.hpp>
+#include "detection.hpp"
+#include "timing.hpp"
+#include "result_cache.hpp"
+
+namespace detection
+{
+	// Runs a set of tests as a dependency graph on every processor entering the same broadcast.
+	// - Ready tests are kept in an atomic bitmask, processors claim the lowest one with a CAS.
+	// - Each test writes into its own node, nodes are merged into the result in registry order once done.
+	// - Budgets are not enforced while a test runs, a test is skipped once the total budget is exhausted, or on the
+	//   next call if its last run exceeded its own budget.
+	// - Dependencies of the selected tests are always run in the graph, even if not selected themselves, and a test is
+	//   skipped if any of its dependencies did not complete.
+	// - Invariant tests are resolved from the result cache on construction unless a refresh is requested.
+	// - Tests are skipped once the posterior crosses the stopping threshold, completed ones update it as they finish.
+	//   Swept results update it on merge, after the stopping decisions of the broadcast were made.
+	// - Swept tests run on every processor once the graph is drained, each into its own slot, unless one of their
+	//   dependencies did not complete. They are reduced on merge into per-key disagreement counts against the first
+	//   processor over the keys raised by any processor, a detection set on any processor is kept.
+	// - The detection keys of the tests that were excluded by the selection or did not complete are listed on merge,
+	//   so that a missing key can be told apart from a clean result.
+	//
+	struct scheduler
+	{
+		static constexpr size_t max_tests = 64;
+
+		struct alignas( 64 ) node
+		{
+			const test_descriptor* test = nullptr;
+			size_t index = 0;
+			uint64_t dependents = 0;
+			uint64_t needs = 0;
+			std::atomic<uint32_t> pending = 0;
+			bool completed = false;
+			bool skipped = false;
+			bool cached = false;
+			bool stopped = false;
+			bool swept = false;
+			bool pulled = false;
+			bool blocked = false;
+			size_t slot_base = 0;
+			uint64_t budget = 0;
+			uint64_t cycles = 0;
+			cbor::object_t result = {};
+			cbor::object_t detections = {};
+		};
+
+		// Run state, low bits count the running tests, top bit is set while an exclusive test runs.
+		//
+		static constexpr uint32_t exclusive_bit = 1u << 31;
+		std::atomic<uint32_t> state = 0;
+		std::atomic<uint64_t> ready = 0;
+		std::atomic<size_t> done = 0;
+		size_t total = 0;
+		uint64_t deadline = 0;
+		uint64_t fingerprint = 0;
+		std::span<const test_descriptor> registry = {};
+		uint64_t excluded = 0;
+		scoring::posterior score = {};
+		std::array<node, max_tests> nodes = {};
+
+		// Per-processor results of the swept tests.
+		//
+		struct alignas( 64 ) core_slot
+		{
+			bool completed = false;
+			uint64_t cycles = 0;
+			cbor::object_t result = {};
+			cbor::object_t detections = {};
+		};
+		uint64_t swept = 0;
+		size_t processor_count = 0;
+		std::vector<core_slot> core_slots = {};
+
+		// Duration of the last run of each test, indexed by registry position.
+		//
+		inline static std::array<std::atomic<uint64_t>, max_tests> last_cycles = {};
+
+		// Builds the graph from the selected tests of the given risk class.
+		//
+		scheduler( std::span<const test_descriptor> tests, const selection& sel, risk_class risk )
+		{
+			auto index_of = [ & ] ( std::string_view name ) -> size_t
+			{
+				for ( size_t i = 0; i != total; i++ )
+					if ( name == nodes[ i ].test->name )
+						return i;
+				return max_tests;
+			};
+
+			if ( sel.total_budget )
+				deadline = ia32::read_tsc() + sel.total_budget;
+			fingerprint = result_cache::fingerprint();
+			processor_count = ke::query_active_processor_count( nullptr );
+			score.reset( sel.prior, sel.stop_at );
+
+			// Select the tests, then pull in the dependencies of the selected ones regardless of their risk class or the
+			// selection since the state they set up has to be current. Dependencies precede their dependents in the registry.
+			//
+			size_t count = std::min( tests.size(), max_tests );
+			uint64_t selected = 0;
+			uint64_t required = 0;
+			for ( size_t index = 0; index != count; index++ )
+				if ( tests[ index ].risk == risk && sel.allows( tests[ index ] ) )
+					selected |= 1ull << index;
+			for ( size_t index = count; index--; )
+			{
+				if ( !( ( selected | required ) & ( 1ull << index ) ) )
+					continue;
+				for ( auto* dep : tests[ index ].depends )
+				{
+					for ( size_t j = 0; j != index; j++ )
+						if ( dep == std::string_view{ tests[ j ].name } && tests[ j ].vendor_matches() )
+							required |= 1ull << j;
+				}
+			}
+
+			registry = tests.first( count );
+			for ( size_t index = 0; index != count; index++ )
+			{
+				auto& test = tests[ index ];
+				uint64_t bit = 1ull << index;
+				if ( !( ( selected | required ) & bit ) )
+				{
+					if ( test.risk == risk && test.vendor_matches() )
+						excluded |= bit;
+					continue;
+				}
+				auto& n = nodes[ total ];
+				n.test = &test;
+				n.index = index;
+				n.budget = sel.budget_of( test.name );
+				n.pulled = !( selected & bit );
+
+				// Run swept tests outside of the graph, on every processor.
+				//
+				if ( sel.sweeps( test ) && !( required & bit ) )
+				{
+					for ( auto* dep : test.depends )
+					{
+						if ( size_t i = index_of( dep ); i != max_tests )
+							n.needs |= 1ull << i;
+						else
+							n.blocked = true;
+					}
+					n.swept = true;
+					n.slot_base = core_slots.size();
+					core_slots.resize( core_slots.size() + processor_count );
+					swept |= 1ull << total;
+					++done;
+					total++;
+					continue;
+				}
+
+				// Resolve invariant tests from the cache.
+				//
+				if ( test.has( invariant ) && !sel.refresh && !( required & bit ) && result_cache::load( index, fingerprint, n.result, n.detections ) )
+				{
+					n.completed = true;
+					n.cached = true;
+					score.add( n.detections );
+					++done;
+					total++;
+					continue;
+				}
+
+				// Wait for the dependencies, a missing one only exists if it does not apply to this processor.
+				//
+				uint32_t pending = 0;
+				for ( auto* dep : test.depends )
+				{
+					if ( size_t i = index_of( dep ); i != max_tests )
+					{
+						nodes[ i ].dependents |= 1ull << total;
+						pending++;
+					}
+					else
+					{
+						n.blocked = true;
+					}
+				}
+				n.pending = pending;
+				if ( !pending )
+					ready |= 1ull << total;
+				total++;
+			}
+		}
+
+		// No copy allowed.
+		//
+		scheduler( const scheduler& ) = delete;
+
+		// Tries to reserve a run slot.
+		//
+		bool acquire( bool exclusive )
+		{
+			uint32_t s = state.load();
+			if ( exclusive ? s != 0 : ( s & exclusive_bit ) != 0 )
+				return false;
+			return state.compare_exchange_strong( s, exclusive ? exclusive_bit : s + 1 );
+		}
+		void release( bool exclusive )
+		{
+			if ( exclusive )
+				state.store( 0 );
+			else
+				--state;
+		}
+
+		// Checks whether or not a test should be skipped to stay within the budgets, a running test is never aborted.
+		// - A test whose last run exceeded its budget is skipped next time, the recorded duration decays on every skip
+		//   so that it is eventually retried.
+		//
+		bool over_budget( node& n )
+		{
+			if ( deadline && ia32::read_tsc() > deadline )
+				return true;
+			auto& last = last_cycles[ n.index ];
+			if ( n.budget && last.load() > n.budget )
+			{
+				last.store( last.load() / 2 );
+				return true;
+			}
+			return false;
+		}
+
+		// Runs a single node and releases its dependents.
+		//
+		void execute( size_t i, const context& ctx )
+		{
+			auto& n = nodes[ i ];
+			if ( n.blocked )
+			{
+				n.skipped = true;
+			}
+			else if ( score.conclusive() )
+			{
+				n.skipped = true;
+				n.stopped = true;
+			}
+			else if ( over_budget( n ) )
+			{
+				n.skipped = true;
+			}
+			else
+			{
+				timing::stopwatch sw = {};
+				n.test->fn( n.result, n.detections, ctx );
+				n.cycles = sw.elapsed();
+				n.completed = true;
+				last_cycles[ n.index ] = n.cycles;
+				score.add( n.detections );
+				if ( n.test->has( invariant ) )
+					result_cache::store( n.index, fingerprint, n.result, n.detections );
+			}
+
+			// Block the dependents if it did not complete, written before the release so that they observe it.
+			//
+			xstd::bit_enum( n.dependents, [ & ] ( bitcnt_t d )
+			{
+				if ( !n.completed )
+					nodes[ d ].blocked = true;
+				if ( !--nodes[ d ].pending )
+					ready |= 1ull << d;
+			} );
+			++done;
+		}
+
+		// Checks whether or not any test is left to run.
+		//
+		bool pending_work() const
+		{
+			return done.load() != total || swept;
+		}
+
+		// Checks whether or not any test was skipped due to the stopping threshold.
+		//
+		bool stopped_early() const
+		{
+			for ( size_t i = 0; i != total; i++ )
+				if ( nodes[ i ].stopped )
+					return true;
+			return false;
+		}
+
+		// Checks whether or not every dependency of a swept test completed, only valid once the graph is drained.
+		//
+		bool dependencies_completed( const node& n ) const
+		{
+			bool result = true;
+			xstd::bit_enum( n.needs, [ & ] ( bitcnt_t d ) { result &= nodes[ d ].completed; } );
+			return result;
+		}
+
+		// Runs the swept tests on the current processor.
+		//
+		void sweep( const context& ctx )
+		{
+			size_t core = nt::read_pcid();
+			if ( core >= processor_count || score.conclusive() )
+				return;
+			xstd::bit_enum( swept, [ & ] ( bitcnt_t i )
+			{
+				auto& n = nodes[ i ];
+				if ( n.blocked || !dependencies_completed( n ) )
+					return;
+				auto& slot = core_slots[ n.slot_base + core ];
+				timing::stopwatch sw = {};
+				n.test->fn( slot.result, slot.detections, ctx );
+				slot.cycles = sw.elapsed();
+				slot.completed = true;
+			} );
+		}
+
+		// Reduces the per-processor results of a swept test into the node, counting the processors that disagree with the first one.
+		// - Keys missing on either side disagree, so that a key raised by a single processor is counted.
+		// - The result of the first processor is kept, completed by the keys only others raised and by the detections
+		//   only others set.
+		//
+		void reduce( node& n, cbor::object_t& disagreements )
+		{
+			core_slot* first = nullptr;
+			for ( size_t core = 0; core != processor_count; core++ )
+			{
+				auto& slot = core_slots[ n.slot_base + core ];
+				if ( !slot.completed )
+					continue;
+				n.cycles = std::max( n.cycles, slot.cycles );
+				if ( !first )
+				{
+					first = &slot;
+					continue;
+				}
+				for ( auto [theirs, ours] : { std::pair{ &slot.result, &first->result }, std::pair{ &slot.detections, &first->detections } } )
+				{
+					for ( auto& [k, v] : *ours )
+					{
+						auto it = theirs->find( k );
+						auto& count = disagreements[ k ].integer();
+						count += it == theirs->end() || !( it->second == v );
+					}
+					for ( auto& [k, v] : *theirs )
+						if ( ours->find( k ) == ours->end() )
+							disagreements[ k ].integer()++;
+				}
+			}
+			if ( !first )
+				return;
+
+			n.result = std::move( first->result );
+			n.detections = std::move( first->detections );
+			n.completed = true;
+			for ( size_t core = 0; core != processor_count; core++ )
+			{
+				auto& slot = core_slots[ n.slot_base + core ];
+				if ( !slot.completed || &slot == first )
+					continue;
+				for ( auto& [k, v] : slot.result )
+					if ( n.result.find( k ) == n.result.end() )
+						n.result[ k ] = std::move( v );
+				for ( auto& [k, v] : slot.detections )
+				{
+					auto it = n.detections.find( k );
+					if ( it == n.detections.end() || ( scoring::is_set( v ) && !scoring::is_set( it->second ) ) )
+						n.detections[ k ] = std::move( v );
+				}
+			}
+		}
+
+		// Called by every processor in the broadcast, returns once all tests have completed.
+		//
+		void work( const context& ctx )
+		{
+			while ( done.load() != total )
+			{
+				// Pick the lowest ready test, if it cannot start yet wait rather than overtaking it.
+				//
+				uint64_t r = ready.load();
+				if ( !r )
+				{
+					yield_cpu();
+					continue;
+				}
+				size_t i = std::countr_zero( r );
+				uint64_t bit = 1ull << i;
+				bool exclusive = nodes[ i ].test->has( detection::exclusive );
+				if ( !acquire( exclusive ) )
+				{
+					yield_cpu();
+					continue;
+				}
+
+				// Claim it, if someone else did first try again.
+				//
+				if ( ready.fetch_and( ~bit ) & bit )
+					execute( i, ctx );
+				release( exclusive );
+			}
+			if ( swept )
+				sweep( ctx );
+		}
+
+		// Merges the node results and timings into the export result in registry order.
+		//
+		void merge( const context& ctx, cbor::array_t& ran, cbor::object_t& timings, cbor::array_t& untested )
+		{
+			auto mark_untested = [ & ] ( const test_descriptor& test )
+			{
+				for ( auto* key : test.keys )
+					untested.emplace_back( key );
+			};
+			xstd::bit_enum( excluded, [ & ] ( bitcnt_t i ) { mark_untested( registry[ i ] ); } );
+
+			bool mismatch = false;
+			for ( size_t i = 0; i != total; i++ )
+			{
+				auto& n = nodes[ i ];
+				if ( n.swept )
+				{
+					auto& disagreements = ctx.data[ "sweep" ].object()[ n.test->name ].object();
+					reduce( n, disagreements );
+					if ( n.completed )
+						score.add( n.detections );
+					for ( auto& [k, v] : disagreements )
+						mismatch |= v.integer() != 0;
+				}
+
+				auto& entry = timing::record( timings, n.test->name, n.cycles, n.budget, n.skipped );
+				if ( n.cached )
+					entry[ "cached" ] = true;
+				if ( n.stopped )
+					entry[ "stopped" ] = true;
+				if ( n.blocked )
+					entry[ "blocked" ] = true;
+				if ( n.pulled )
+					entry[ "dependency" ] = true;
+				if ( !n.completed )
+				{
+					mark_untested( *n.test );
+					continue;
+				}
+				auto& section = ctx.data[ n.test->section ].object();
+				for ( auto& [k, v] : n.result )
+					section[ k ] = std::move( v );
+				for ( auto& [k, v] : n.detections )
+					ctx.detections[ k ] = std::move( v );
+				ran.emplace_back( n.test->name );
+			}
+			if ( swept )
+			{
+				ctx.data[ "sweep" ].object()[ "processors" ] = processor_count;
+				ctx.detections[ "vm.perCoreMismatch" ] = mismatch;
+				score.add( cbor::object_t{ { "vm.perCoreMismatch", mismatch } } );
+			}
+		}
+	};
+};
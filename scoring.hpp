@@ -0,0 +1,203 @@
+#pragma once
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <string_view>
+
+// The Linux build only has the weights and the posterior, the detections are read from CBOR in the driver.
+//
+#if !defined( __linux__ )
+	#include <ntpp.hpp>
+#endif
+
+// Bayesian scoring of the detections.
+// - Evidence is accumulated as log-odds in decibans (10 * log10 of the likelihood ratio), so that factors sum.
+// - Weights are given per key for both outcomes, absence of an artifact is weak evidence for bare metal.
+// - The weights, metric thresholds and prior are provisional estimates from the relative reliability of the tests, they
+//   have not been fitted against labelled runs and should be treated as such until they are.
+// - Early stopping is one-sided, the posterior is conclusive once the evidence moved it at least the threshold away from
+//   the prior towards a hypervisor. Bare metal is never concluded early since it is the outcome the strong, expensive
+//   tests exist to contradict, and a threshold below the magnitude of the prior would otherwise stop before any test.
+//
+namespace scoring
+{
+	// Prior odds of running under a hypervisor, -10 dB is 1:10.
+	//
+	static constexpr int32_t default_prior = -10;
+
+	// Bounds of the posterior when converting it to a probability.
+	//
+	static constexpr int32_t max_log_odds = 200;
+
+	// Likelihood ratios of the boolean detections, when set and when clear, provisional.
+	//
+	struct detection_weight
+	{
+		const char* key;
+		int16_t     present;
+		int16_t     absent;
+	};
+	static constexpr detection_weight detection_weights[] = {
+		{ "vm.vmxe",                 30,  -3 },
+		{ "vm.hvFlagSet",            12,  -6 },
+		{ "vm.hvMsrs",               20,  -2 },
+		{ "vm.vmwareIo",             40,   0 },
+		{ "vm.smiSuppressed",        15,  -2 },
+		{ "vm.nullClock",            25,   0 },
+		{ "vm.hiddenClocks",         15,  -1 },
+		{ "vm.tscWarped",            10,  -1 },
+		{ "vm.strEmulFail",          30,  -1 },
+		{ "vm.sldtEmulFail",         30,  -1 },
+		{ "vm.dbSuppressed",         35,  -2 },
+		{ "vm.turboSuppressed",       8,  -1 },
+		{ "vm.pmcMsrMismatch",       20,  -1 },
+		{ "vm.rdpmcMismatch",        20,  -1 },
+		{ "vm.rdpmcFaulted",         25,  -1 },
+		{ "vm.pmcDead",              20,  -2 },
+		{ "vm.pebsSuppressed",       10,  -1 },
+		{ "vm.lbrSuppressed",        15,  -1 },
+		{ "vm.btsOsFault",           15,  -1 },
+		{ "vm.btsOsSuppressed",      12,  -1 },
+		{ "vm.btfSuppressed",        25,  -1 },
+		{ "vm.ptSuppressed",          8,  -1 },
+		{ "vm.cpuidEcxSuppressed",   30,  -1 },
+		{ "vm.xsaveSizeMismatch",    25,  -1 },
+		{ "vm.xsavesSizeMismatch",   25,  -1 },
+		{ "vm.xsaveFaulted",         30,  -1 },
+		{ "vm.xsaveOverflow",        30,  -1 },
+		{ "vm.xgetbvEmulFail",       35,  -1 },
+		{ "vm.xsetbvLeafEmulFail",   35,  -1 },
+		{ "vm.xsetbvLeafEmulFail2",  35,  -1 },
+		{ "vm.xsetbvValueEmulFail",  35,  -1 },
+		{ "vm.smswEmulFail",         30,  -1 },
+		{ "vm.msrDefaultInvalid",    20,  -1 },
+		{ "vm.tscMsrEmulFail",       30,  -1 },
+		{ "vm.eferNxDiscard",        35,  -1 },
+		{ "vm.perCoreMismatch",      15,  -1 },
+	};
+
+	// Likelihood ratios of the benchmark medians, when above and below the threshold in TSC cycles, provisional.
+	//
+	struct metric_weight
+	{
+		const char* name;
+		uint32_t    threshold;
+		int16_t     above;
+		int16_t     below;
+	};
+	static constexpr metric_weight metric_weights[] = {
+		{ "cpuid",  500, 30, -10 },
+		{ "xsetbv", 700, 20,  -5 },
+	};
+
+#if !defined( __linux__ )
+	// Reads a detection, which is either a boolean or a count.
+	//
+	inline bool is_set( const cbor::instance& value )
+	{
+		if ( value.is_boolean() )
+			return value.boolean();
+		return value.is_integer() && value.integer() != 0;
+	}
+
+	// Sums the weights of the detections present in the set.
+	//
+	inline int32_t weigh( const cbor::object_t& detections )
+	{
+		int32_t sum = 0;
+		for ( auto& w : detection_weights )
+		{
+			auto it = detections.find( cbor::string_t{ w.key } );
+			if ( it != detections.end() )
+				sum += is_set( it->second ) ? w.present : w.absent;
+		}
+		return sum;
+	}
+#endif
+
+	// Running posterior, updated concurrently as tests complete.
+	//
+	struct posterior
+	{
+		std::atomic<int32_t> log_odds = default_prior;
+		int32_t prior = default_prior;
+		int32_t threshold = 0;
+
+		void reset( int32_t p, int32_t t )
+		{
+			prior = p;
+			log_odds = p;
+			threshold = t;
+		}
+		void add( int32_t weight ) { log_odds += weight; }
+#if !defined( __linux__ )
+		void add( const cbor::object_t& detections ) { add( weigh( detections ) ); }
+#endif
+
+		// Checks whether or not the evidence already moved the posterior the stopping threshold towards a hypervisor.
+		//
+		bool conclusive() const { return threshold && ( log_odds.load() - prior ) >= threshold; }
+	};
+
+	// Converts log-odds in decibans to a probability.
+	//
+	inline double to_probability( int32_t log_odds )
+	{
+		constexpr double step = 1.2589254117941673; // 10^0.1
+		log_odds = std::clamp( log_odds, -max_log_odds, max_log_odds );
+		double odds = 1.0;
+		for ( int32_t i = 0; i != std::abs( log_odds ); i++ )
+			odds *= step;
+		if ( log_odds < 0 )
+			odds = 1.0 / odds;
+		return odds / ( 1.0 + odds );
+	}
+
+#if !defined( __linux__ )
+	// Scores the final result and writes the report along with the contributing factors.
+	//
+	inline void report( cbor::object_t& out, const cbor::object_t& detections, const cbor::object_t& data, int32_t prior, int32_t threshold, bool stopped )
+	{
+		int32_t log_odds = prior;
+		auto& factors = out[ "factors" ].array();
+		auto add = [ & ] ( const char* key, int32_t weight )
+		{
+			if ( !weight )
+				return;
+			log_odds += weight;
+			factors.push_back( cbor::object_t{ { "key", key }, { "weight", weight } } );
+		};
+
+		for ( auto& w : detection_weights )
+		{
+			auto it = detections.find( cbor::string_t{ w.key } );
+			if ( it != detections.end() )
+				add( w.key, is_set( it->second ) ? w.present : w.absent );
+		}
+
+		if ( auto bench = data.find( cbor::string_t{ "benchmarks" } ); bench != data.end() && bench->second.is_object() )
+		{
+			for ( auto& w : metric_weights )
+			{
+				auto& metrics = bench->second.object();
+				auto it = metrics.find( cbor::string_t{ w.name } );
+				if ( it == metrics.end() || !it->second.is_object() )
+					continue;
+				auto tsc = it->second.object().find( cbor::string_t{ "tsc" } );
+				if ( tsc != it->second.object().end() )
+					add( w.name, tsc->second.fp() > w.threshold ? w.above : w.below );
+			}
+		}
+
+		out[ "prior" ] = prior;
+		out[ "logOdds" ] = log_odds;
+		out[ "probability" ] = cbor::fp_t( to_probability( log_odds ) );
+		out[ "virtualized" ] = log_odds > 0;
+		if ( threshold )
+			out[ "threshold" ] = threshold;
+		if ( stopped )
+			out[ "stoppedEarly" ] = true;
+	}
+#endif
+};
@@ -0,0 +1,428 @@
+#pragma once
+#include <bit>
+#include <array>
+#include <algorithm>
+#include <span>
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+
+// The Linux build is used by the tests and benchmarks, where the extended state needs no saving.
+//
+#if defined( __linux__ )
+	#ifndef FORCE_INLINE
+		#define FORCE_INLINE __attribute__( ( always_inline ) )
+	#endif
+#else
+	#include <ntpp.hpp>
+	#include <sdk/ke/api.hpp>
+#endif
+
+// Vectorized kernels used by the image verification.
+// - The widest supported instruction set is selected at runtime, every level produces identical results.
+// - AVX state has to be saved in kernel mode, kernels are run within a scope that saves it and falls back to SSE if
+//   that fails. Legacy SSE state is preserved by the kernel itself.
+//
+namespace simd
+{
+	enum class level : uint8_t
+	{
+		scalar,
+		sse42,
+		avx2,
+		avx512,
+	};
+
+	// Reads a CPUID leaf.
+	//
+	inline std::array<uint32_t, 4> read_cpuid( uint32_t leaf, uint32_t subleaf )
+	{
+		std::array<uint32_t, 4> r;
+		asm volatile( "cpuid" : "=a" ( r[ 0 ] ), "=b" ( r[ 1 ] ), "=c" ( r[ 2 ] ), "=d" ( r[ 3 ] ) : "a" ( leaf ), "c" ( subleaf ) );
+		return r;
+	}
+
+	// Reads the enabled state components.
+	//
+	inline uint64_t read_xcr0()
+	{
+		uint32_t lo, hi;
+		asm volatile( "xgetbv" : "=a" ( lo ), "=d" ( hi ) : "c" ( 0 ) );
+		return lo | ( uint64_t( hi ) << 32 );
+	}
+
+	// Detects the widest usable level.
+	// - AVX-512 requires F, DQ, BW and VL along with the opmask and upper ZMM state enabled.
+	//
+	inline level detect()
+	{
+		auto l1 = read_cpuid( 1, 0 );
+		auto l7 = read_cpuid( 7, 0 );
+		if ( !( ( l1[ 2 ] >> 20 ) & 1 ) )
+			return level::scalar;
+		if ( !( ( l1[ 2 ] >> 27 ) & 1 ) )
+			return level::sse42;
+		uint64_t xcr0 = read_xcr0();
+		if ( ( xcr0 & 0x6 ) != 0x6 || !( ( l7[ 1 ] >> 5 ) & 1 ) )
+			return level::sse42;
+		constexpr uint32_t avx512_mask = ( 1u << 16 ) | ( 1u << 17 ) | ( 1u << 30 ) | ( 1u << 31 );
+		if ( ( xcr0 & 0xE6 ) != 0xE6 || ( l7[ 1 ] & avx512_mask ) != avx512_mask )
+			return level::avx2;
+		return level::avx512;
+	}
+	inline const level supported = detect();
+
+	// Saves the extended state for the duration of the scope.
+	//
+	struct scope
+	{
+		level lv = supported;
+#if defined( __linux__ )
+		scope() = default;
+		scope( level lv ) : lv( std::min( lv, supported ) ) {}
+		scope( const scope& ) = delete;
+#else
+		static constexpr uint64_t xstate_avx = 1ull << 2;
+		static constexpr uint64_t xstate_avx512 = 7ull << 5;
+
+		nt::xstate_save_t state = {};
+		bool saved = false;
+
+		scope()
+		{
+			if ( lv >= level::avx2 )
+			{
+				uint64_t mask = lv == level::avx512 ? ( xstate_avx | xstate_avx512 ) : xstate_avx;
+				saved = NT_SUCCESS( ke::save_extended_processor_state( mask, &state ) );
+				if ( !saved )
+					lv = level::sse42;
+			}
+		}
+		scope( const scope& ) = delete;
+		~scope()
+		{
+			if ( saved )
+				ke::restore_extended_processor_state( &state );
+		}
+#endif
+	};
+
+	// Checks whether or not two ranges are equal.
+	//
+	[[gnu::target( "sse4.2" )]] inline bool equal_sse42( const uint8_t* a, const uint8_t* b, size_t n )
+	{
+		size_t i = 0;
+		for ( ; ( i + 64 ) <= n; i += 64 )
+		{
+			__m128i x0 = _mm_xor_si128( _mm_loadu_si128( ( const __m128i* ) ( a + i ) ),      _mm_loadu_si128( ( const __m128i* ) ( b + i ) ) );
+			__m128i x1 = _mm_xor_si128( _mm_loadu_si128( ( const __m128i* ) ( a + i + 16 ) ), _mm_loadu_si128( ( const __m128i* ) ( b + i + 16 ) ) );
+			__m128i x2 = _mm_xor_si128( _mm_loadu_si128( ( const __m128i* ) ( a + i + 32 ) ), _mm_loadu_si128( ( const __m128i* ) ( b + i + 32 ) ) );
+			__m128i x3 = _mm_xor_si128( _mm_loadu_si128( ( const __m128i* ) ( a + i + 48 ) ), _mm_loadu_si128( ( const __m128i* ) ( b + i + 48 ) ) );
+			__m128i x = _mm_or_si128( _mm_or_si128( x0, x1 ), _mm_or_si128( x2, x3 ) );
+			if ( !_mm_testz_si128( x, x ) )
+				return false;
+		}
+		for ( ; ( i + 16 ) <= n; i += 16 )
+		{
+			__m128i x = _mm_xor_si128( _mm_loadu_si128( ( const __m128i* ) ( a + i ) ), _mm_loadu_si128( ( const __m128i* ) ( b + i ) ) );
+			if ( !_mm_testz_si128( x, x ) )
+				return false;
+		}
+		return !memcmp( a + i, b + i, n - i );
+	}
+	[[gnu::target( "avx2" )]] inline bool equal_avx2( const uint8_t* a, const uint8_t* b, size_t n )
+	{
+		size_t i = 0;
+		for ( ; ( i + 128 ) <= n; i += 128 )
+		{
+			__m256i x0 = _mm256_xor_si256( _mm256_loadu_si256( ( const __m256i* ) ( a + i ) ),      _mm256_loadu_si256( ( const __m256i* ) ( b + i ) ) );
+			__m256i x1 = _mm256_xor_si256( _mm256_loadu_si256( ( const __m256i* ) ( a + i + 32 ) ), _mm256_loadu_si256( ( const __m256i* ) ( b + i + 32 ) ) );
+			__m256i x2 = _mm256_xor_si256( _mm256_loadu_si256( ( const __m256i* ) ( a + i + 64 ) ), _mm256_loadu_si256( ( const __m256i* ) ( b + i + 64 ) ) );
+			__m256i x3 = _mm256_xor_si256( _mm256_loadu_si256( ( const __m256i* ) ( a + i + 96 ) ), _mm256_loadu_si256( ( const __m256i* ) ( b + i + 96 ) ) );
+			__m256i x = _mm256_or_si256( _mm256_or_si256( x0, x1 ), _mm256_or_si256( x2, x3 ) );
+			if ( !_mm256_testz_si256( x, x ) )
+				return false;
+		}
+		for ( ; ( i + 32 ) <= n; i += 32 )
+		{
+			__m256i x = _mm256_xor_si256( _mm256_loadu_si256( ( const __m256i* ) ( a + i ) ), _mm256_loadu_si256( ( const __m256i* ) ( b + i ) ) );
+			if ( !_mm256_testz_si256( x, x ) )
+				return false;
+		}
+		return !memcmp( a + i, b + i, n - i );
+	}
+	[[gnu::target( "avx512f,avx512bw" )]] inline bool equal_avx512( const uint8_t* a, const uint8_t* b, size_t n )
+	{
+		size_t i = 0;
+		for ( ; ( i + 128 ) <= n; i += 128 )
+		{
+			__m512i x0 = _mm512_xor_si512( _mm512_loadu_si512( a + i ),      _mm512_loadu_si512( b + i ) );
+			__m512i x1 = _mm512_xor_si512( _mm512_loadu_si512( a + i + 64 ), _mm512_loadu_si512( b + i + 64 ) );
+			__m512i x = _mm512_or_si512( x0, x1 );
+			if ( _mm512_test_epi64_mask( x, x ) )
+				return false;
+		}
+		for ( ; i < n; i += 64 )
+		{
+			__mmask64 m = ( n - i ) >= 64 ? ~0ull : ( ( 1ull << ( n - i ) ) - 1 );
+			if ( _mm512_mask_cmpneq_epi8_mask( m, _mm512_maskz_loadu_epi8( m, a + i ), _mm512_maskz_loadu_epi8( m, b + i ) ) )
+				return false;
+		}
+		return true;
+	}
+	inline bool equal( level lv, const uint8_t* a, const uint8_t* b, size_t n )
+	{
+		switch ( lv )
+		{
+			case level::avx512: return equal_avx512( a, b, n );
+			case level::avx2:   return equal_avx2( a, b, n );
+			case level::sse42:  return equal_sse42( a, b, n );
+			default:            return !memcmp( a, b, n );
+		}
+	}
+
+	// Checks whether or not two ranges are equal ignoring the bytes set in the mask, bit i of word w covers byte 64 * w + i.
+	// - Vector kernels expand the mask bits into byte masks with a shuffle and a compare against the bit of each byte.
+	//
+	inline bool equal_masked_scalar( const uint8_t* a, const uint8_t* b, const uint64_t* mask, size_t n )
+	{
+		for ( size_t i = 0; i < n; i += 64 )
+		{
+			size_t count = std::min<size_t>( n - i, 64 );
+			uint64_t m = mask[ i / 64 ];
+			if ( !m )
+			{
+				if ( memcmp( a + i, b + i, count ) )
+					return false;
+				continue;
+			}
+			for ( size_t j = 0; j != count; j++ )
+				if ( !( ( m >> j ) & 1 ) && a[ i + j ] != b[ i + j ] )
+					return false;
+		}
+		return true;
+	}
+	[[gnu::target( "sse4.2" )]] inline bool equal_masked_sse42( const uint8_t* a, const uint8_t* b, const uint64_t* mask, size_t n )
+	{
+		const __m128i select = _mm_set1_epi64x( 0x8040201008040201 );
+		const __m128i spread = _mm_setr_epi8( 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1 );
+		size_t i = 0;
+		for ( ; ( i + 64 ) <= n; i += 64 )
+		{
+			uint64_t m = mask[ i / 64 ];
+			__m128i x = _mm_setzero_si128();
+			for ( size_t j = 0; j != 4; j++ )
+			{
+				__m128i skip = _mm_shuffle_epi8( _mm_cvtsi32_si128( int( m >> ( j * 16 ) ) ), spread );
+				skip = _mm_cmpeq_epi8( _mm_and_si128( skip, select ), select );
+				__m128i d = _mm_xor_si128( _mm_loadu_si128( ( const __m128i* ) ( a + i + j * 16 ) ), _mm_loadu_si128( ( const __m128i* ) ( b + i + j * 16 ) ) );
+				x = _mm_or_si128( x, _mm_andnot_si128( skip, d ) );
+			}
+			if ( !_mm_testz_si128( x, x ) )
+				return false;
+		}
+		return equal_masked_scalar( a + i, b + i, mask + i / 64, n - i );
+	}
+	[[gnu::target( "avx2" )]] inline bool equal_masked_avx2( const uint8_t* a, const uint8_t* b, const uint64_t* mask, size_t n )
+	{
+		const __m256i select = _mm256_set1_epi64x( 0x8040201008040201 );
+		const __m256i spread = _mm256_setr_epi8(
+			0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+			2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3
+		);
+		size_t i = 0;
+		for ( ; ( i + 64 ) <= n; i += 64 )
+		{
+			uint64_t m = mask[ i / 64 ];
+			__m256i x = _mm256_setzero_si256();
+			for ( size_t j = 0; j != 2; j++ )
+			{
+				__m256i skip = _mm256_shuffle_epi8( _mm256_set1_epi32( int( m >> ( j * 32 ) ) ), spread );
+				skip = _mm256_cmpeq_epi8( _mm256_and_si256( skip, select ), select );
+				__m256i d = _mm256_xor_si256( _mm256_loadu_si256( ( const __m256i* ) ( a + i + j * 32 ) ), _mm256_loadu_si256( ( const __m256i* ) ( b + i + j * 32 ) ) );
+				x = _mm256_or_si256( x, _mm256_andnot_si256( skip, d ) );
+			}
+			if ( !_mm256_testz_si256( x, x ) )
+				return false;
+		}
+		return equal_masked_scalar( a + i, b + i, mask + i / 64, n - i );
+	}
+	[[gnu::target( "avx512f,avx512bw" )]] inline bool equal_masked_avx512( const uint8_t* a, const uint8_t* b, const uint64_t* mask, size_t n )
+	{
+		for ( size_t i = 0; i < n; i += 64 )
+		{
+			__mmask64 m = ( n - i ) >= 64 ? ~0ull : ( ( 1ull << ( n - i ) ) - 1 );
+			m &= ~mask[ i / 64 ];
+			if ( _mm512_mask_cmpneq_epi8_mask( m, _mm512_maskz_loadu_epi8( m, a + i ), _mm512_maskz_loadu_epi8( m, b + i ) ) )
+				return false;
+		}
+		return true;
+	}
+	inline bool equal_masked( level lv, const uint8_t* a, const uint8_t* b, const uint64_t* mask, size_t n )
+	{
+		if ( !mask )
+			return equal( lv, a, b, n );
+		switch ( lv )
+		{
+			case level::avx512: return equal_masked_avx512( a, b, mask, n );
+			case level::avx2:   return equal_masked_avx2( a, b, mask, n );
+			case level::sse42:  return equal_masked_sse42( a, b, mask, n );
+			default:            return equal_masked_scalar( a, b, mask, n );
+		}
+	}
+
+	// Sixteen lane multiply-rotate hash, each lane consumes every sixteenth word of a 128 byte stripe with the XXH64
+	// round so that the lanes map onto two ZMM, four YMM or sixteen independent scalar chains.
+	//
+	struct lane_hash
+	{
+		static constexpr uint64_t p1 = 0x9E3779B185EBCA87;
+		static constexpr uint64_t p2 = 0xC2B2AE3D27D4EB4F;
+		static constexpr uint64_t p3 = 0x165667B19E3779F9;
+		static constexpr uint64_t p4 = 0x85EBCA77C2B2AE63;
+		static constexpr uint64_t p5 = 0x27D4EB2F165667C5;
+		static constexpr size_t lane_count = 16;
+		static constexpr size_t stripe = lane_count * 8;
+
+		level lv = level::scalar;
+		alignas( 64 ) std::array<uint64_t, lane_count> lanes = {};
+		std::array<uint8_t, stripe> pending = {};
+		size_t pending_length = 0;
+		uint64_t total = 0;
+
+		lane_hash( level lv = level::scalar ) : lv( lv )
+		{
+			for ( size_t i = 0; i != lane_count; i++ )
+				lanes[ i ] = p1 + p2 + i * p5;
+		}
+
+		FORCE_INLINE static uint64_t round( uint64_t acc, uint64_t input )
+		{
+			acc += input * p2;
+			return std::rotl( acc, 31 ) * p1;
+		}
+		FORCE_INLINE static uint64_t read64( const uint8_t* p )
+		{
+			uint64_t v;
+			memcpy( &v, p, sizeof( v ) );
+			return v;
+		}
+
+		// Consumes whole stripes.
+		//
+		static void consume_scalar( uint64_t* lanes, const uint8_t* p, size_t stripes )
+		{
+			for ( size_t s = 0; s != stripes; s++, p += stripe )
+				for ( size_t i = 0; i != lane_count; i++ )
+					lanes[ i ] = round( lanes[ i ], read64( p + i * 8 ) );
+		}
+		[[gnu::target( "avx2" )]] static __m256i mul64_avx2( __m256i x, __m256i c )
+		{
+			__m256i lo = _mm256_mul_epu32( x, c );
+			__m256i cross = _mm256_add_epi64( _mm256_mul_epu32( _mm256_srli_epi64( x, 32 ), c ), _mm256_mul_epu32( x, _mm256_srli_epi64( c, 32 ) ) );
+			return _mm256_add_epi64( lo, _mm256_slli_epi64( cross, 32 ) );
+		}
+		[[gnu::target( "avx2" )]] static void consume_avx2( uint64_t* lanes, const uint8_t* p, size_t stripes )
+		{
+			const __m256i k1 = _mm256_set1_epi64x( int64_t( p1 ) );
+			const __m256i k2 = _mm256_set1_epi64x( int64_t( p2 ) );
+			__m256i acc[ 4 ];
+			for ( size_t i = 0; i != 4; i++ )
+				acc[ i ] = _mm256_load_si256( ( const __m256i* ) ( lanes + i * 4 ) );
+			for ( size_t s = 0; s != stripes; s++, p += stripe )
+			{
+				for ( size_t i = 0; i != 4; i++ )
+				{
+					__m256i a = _mm256_add_epi64( acc[ i ], mul64_avx2( _mm256_loadu_si256( ( const __m256i* ) ( p + i * 32 ) ), k2 ) );
+					a = _mm256_or_si256( _mm256_slli_epi64( a, 31 ), _mm256_srli_epi64( a, 33 ) );
+					acc[ i ] = mul64_avx2( a, k1 );
+				}
+			}
+			for ( size_t i = 0; i != 4; i++ )
+				_mm256_store_si256( ( __m256i* ) ( lanes + i * 4 ), acc[ i ] );
+		}
+		[[gnu::target( "avx512f,avx512dq" )]] static void consume_avx512( uint64_t* lanes, const uint8_t* p, size_t stripes )
+		{
+			const __m512i k1 = _mm512_set1_epi64( int64_t( p1 ) );
+			const __m512i k2 = _mm512_set1_epi64( int64_t( p2 ) );
+			__m512i a0 = _mm512_load_si512( lanes );
+			__m512i a1 = _mm512_load_si512( lanes + 8 );
+			// The rotation uses the zero-masked form with every lane selected, the unmasked one passes an undefined
+			// vector through that GCC reports as maybe uninitialized.
+			//
+			for ( size_t s = 0; s != stripes; s++, p += stripe )
+			{
+				a0 = _mm512_mullo_epi64( _mm512_maskz_rol_epi64( 0xFF, _mm512_add_epi64( a0, _mm512_mullo_epi64( _mm512_loadu_si512( p ), k2 ) ), 31 ), k1 );
+				a1 = _mm512_mullo_epi64( _mm512_maskz_rol_epi64( 0xFF, _mm512_add_epi64( a1, _mm512_mullo_epi64( _mm512_loadu_si512( p + 64 ), k2 ) ), 31 ), k1 );
+			}
+			_mm512_store_si512( lanes, a0 );
+			_mm512_store_si512( lanes + 8, a1 );
+		}
+		void consume( const uint8_t* p, size_t stripes )
+		{
+			if ( !stripes )
+				return;
+			switch ( lv )
+			{
+				case level::avx512: return consume_avx512( lanes.data(), p, stripes );
+				case level::avx2:   return consume_avx2( lanes.data(), p, stripes );
+				default:            return consume_scalar( lanes.data(), p, stripes );
+			}
+		}
+
+		// Appends data to the hash.
+		//
+		void update( const uint8_t* p, size_t n )
+		{
+			total += n;
+			if ( pending_length )
+			{
+				size_t take = std::min( n, stripe - pending_length );
+				memcpy( pending.data() + pending_length, p, take );
+				pending_length += take;
+				p += take;
+				n -= take;
+				if ( pending_length != stripe )
+					return;
+				consume( pending.data(), 1 );
+				pending_length = 0;
+			}
+			consume( p, n / stripe );
+			p += n - n % stripe;
+			n %= stripe;
+			memcpy( pending.data(), p, n );
+			pending_length = n;
+		}
+
+		// Finalizes the hash.
+		//
+		uint64_t digest() const
+		{
+			uint64_t h = p5 + total;
+			for ( size_t i = 0; i != lane_count; i++ )
+				h = std::rotl( h ^ round( 0, lanes[ i ] ), 27 ) * p1 + p4;
+
+			const uint8_t* p = pending.data();
+			size_t n = pending_length;
+			for ( ; n >= 8; p += 8, n -= 8 )
+				h = std::rotl( h ^ round( 0, read64( p ) ), 27 ) * p1 + p4;
+			if ( n >= 4 )
+			{
+				uint32_t v;
+				memcpy( &v, p, sizeof( v ) );
+				h = std::rotl( h ^ ( v * p1 ), 23 ) * p2 + p3;
+				p += 4;
+				n -= 4;
+			}
+			for ( ; n; p++, n-- )
+				h = std::rotl( h ^ ( *p * p5 ), 11 ) * p1;
+
+			h ^= h >> 33;
+			h *= p2;
+			h ^= h >> 29;
+			h *= p3;
+			h ^= h >> 32;
+			return h;
+		}
+	};
+};
@@ -0,0 +1,74 @@
+#include <cstdio>
+#include <cstdlib>
+#include <optional>
+#include "classifier_model.hpp"
+
+// Replays benchmark medians through the classifier and checks the predicted families.
+// - Each sample holds the TSC medians of the ALU baseline and of the features as reported under "benchmarks", with
+//   the jitter of repeated runs. They are representative of each family rather than captured from labelled machines,
+//   the centroids being provisional as well.
+//
+
+#define CHECK( cond ) \
+	do { if ( !( cond ) ) { fprintf( stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond ); exit( 1 ); } } while ( 0 )
+
+using classifier::family;
+using medians = std::array<std::optional<uint64_t>, classifier::feature_count>;
+
+struct sample
+{
+	const char* label;
+	uint64_t alu;
+	medians features;
+	family expected;
+};
+
+static const sample samples[] = {
+	//  label               alu   cpuid  xsetbv  smi      cpuidLong
+	{ "bare metal",         40,  { 165,   330,    41'000,  160 },   family::bare_metal },
+	{ "bare metal, slow",   52,  { 210,   400,    55'000,  205 },   family::bare_metal },
+	{ "bare metal, no smi", 40,  { 170,   320,    {},      165 },   family::bare_metal },
+	{ "kvm",                40,  { 1'300, 1'250,  2'600,   1'280 }, family::kvm },
+	{ "kvm, fast alu",      33,  { 1'050, 1'060,  2'100,   1'040 }, family::kvm },
+	{ "hyper-v",            40,  { 1'530, 1'600,  3'300,   1'520 }, family::hyperv },
+	{ "vmware",             40,  { 1'800, 2'050,  4'050,   1'790 }, family::vmware },
+	{ "virtualbox",         40,  { 2'950, 3'100,  5'800,   2'900 }, family::virtualbox },
+	{ "xen",                40,  { 1'650, 1'780,  3'750,   1'660 }, family::xen },
+	{ "custom, slow exits", 40,  { 21'000, 22'000, 45'000, 20'500 }, family::custom },
+	{ "custom, no traps",   40,  { 1'300, 1'250,  60,      1'280 }, family::custom },
+};
+
+int main()
+{
+	// Fixed point logarithm.
+	//
+	static_assert( classifier::log2_q8( 1 ) == 0 );
+	static_assert( classifier::log2_q8( 256 ) == 0x800 );
+	static_assert( classifier::log2_q8( 384 ) == 0x880 );
+	static_assert( classifier::log2_q8( 3 ) == 0x180 );
+
+	for ( auto& s : samples )
+	{
+		classifier::vector v;
+		uint32_t mask = classifier::features( s.alu, s.features, v );
+		auto result = classifier::classify( v, mask );
+		printf( "%-20s -> %-10s nearest %-10s distance %llu\n", s.label, classifier::family_names[ size_t( result.kind ) ],
+			classifier::family_names[ size_t( result.nearest ) ], ( unsigned long long ) result.distance );
+		CHECK( result.kind == s.expected );
+		CHECK( result.features == uint32_t( std::popcount( mask ) ) );
+		CHECK( result.runner_up >= result.distance );
+	}
+
+	// A vector at a centroid matches it exactly, a missing baseline or feature set yields nothing to classify.
+	//
+	for ( auto& c : classifier::centroids )
+	{
+		auto result = classifier::classify( c.value, ( 1u << classifier::feature_count ) - 1 );
+		CHECK( result.kind == c.kind && result.distance == 0 );
+	}
+	classifier::vector v;
+	CHECK( classifier::features( 0, samples[ 0 ].features, v ) == 0 );
+	CHECK( classifier::features( 40, medians{}, v ) == 0 );
+	printf( "classifier: ok\n" );
+	return 0;
+}
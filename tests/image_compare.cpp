@@ -0,0 +1,228 @@
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+#include "image_compare.hpp"
+
+// Verifies synthetic images rebased at random against their files.
+// - Each file has two compared sections, a writable one and a relocation directory in a section of its own. The
+//   loaded image is the file laid out by RVA with every relocation shifted by the rebase delta and the import
+//   address table filled with random pointers.
+// - Relocations are also placed across chunk boundaries and across the edges of the compared sections.
+//
+
+#define CHECK( cond ) \
+	do { if ( !( cond ) ) { fprintf( stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond ); exit( 1 ); } } while ( 0 )
+
+static std::mt19937_64 rng{ 0x1AB5 };
+static uint64_t random( uint64_t n ) { return rng() % n; }
+
+// File reader over a byte vector.
+//
+struct memory_file
+{
+	const std::vector<uint8_t>& bytes;
+	size_t read( uint64_t offset, uint8_t* out, size_t n ) const
+	{
+		if ( offset >= bytes.size() )
+			return 0;
+		n = std::min<size_t>( n, bytes.size() - offset );
+		memcpy( out, bytes.data() + offset, n );
+		return n;
+	}
+};
+
+struct synthetic_image
+{
+	std::vector<integrity::section> sections;
+	std::vector<uint8_t> file;
+	std::vector<uint8_t> mem;
+	std::vector<uint32_t> relocs;
+	uint32_t reloc_rva = 0, reloc_size = 0;
+	uint32_t iat_rva = 0, iat_size = 0;
+};
+
+// Builds an image of random layout and content rebased by the delta.
+//
+static synthetic_image make_image( uint64_t delta )
+{
+	synthetic_image img;
+	uint32_t rva = 0x1000, raw = 0x400;
+	auto add = [ & ] ( uint32_t length, bool compared )
+	{
+		img.sections.push_back( { rva, length, raw, compared } );
+		rva += ( length + 0xFFF ) & ~0xFFF;
+		raw += ( length + 0x1FF ) & ~0x1FF;
+	};
+	add( uint32_t( 0x8000 + random( 0x60000 ) ), true );
+	add( uint32_t( 0x100 + random( 0x4000 ) ), false );
+	add( uint32_t( 0x40 + random( 0x20000 ) ), true );
+
+	// Relocations, one every 100 bytes of the compared sections on average plus the edge cases.
+	//
+	std::vector<uint32_t> relocs;
+	for ( auto& s : img.sections )
+	{
+		for ( size_t n = s.length / 100; n; n-- )
+			relocs.push_back( s.rva + uint32_t( random( s.length - 7 ) ) );
+		if ( s.compared )
+		{
+			relocs.push_back( s.rva );
+			relocs.push_back( s.rva + s.length - 8 );
+			for ( uint32_t b = 0x10000; b < s.length; b += 0x10000 )
+				relocs.push_back( s.rva + b - uint32_t( 1 + random( 7 ) ) );
+		}
+	}
+	std::sort( relocs.begin(), relocs.end() );
+	for ( uint32_t r : relocs )
+		if ( img.relocs.empty() || r >= img.relocs.back() + 8 )
+			img.relocs.push_back( r );
+
+	// Relocation directory, one block per page padded to 4 bytes with an absolute entry.
+	//
+	std::vector<uint8_t> dir;
+	for ( size_t i = 0; i != img.relocs.size(); )
+	{
+		uint32_t page = img.relocs[ i ] & ~0xFFF;
+		std::vector<uint16_t> entries;
+		for ( ; i != img.relocs.size() && ( img.relocs[ i ] & ~0xFFF ) == page; i++ )
+			entries.push_back( uint16_t( ( integrity::rel_based_dir64 << 12 ) | ( img.relocs[ i ] & 0xFFF ) ) );
+		if ( entries.size() % 2 )
+			entries.push_back( 0 );
+		uint32_t length = uint32_t( 8 + entries.size() * 2 );
+		size_t at = dir.size();
+		dir.resize( at + length );
+		memcpy( &dir[ at ], &page, 4 );
+		memcpy( &dir[ at + 4 ], &length, 4 );
+		memcpy( &dir[ at + 8 ], entries.data(), entries.size() * 2 );
+	}
+	img.reloc_rva = rva;
+	img.reloc_size = uint32_t( dir.size() );
+	add( img.reloc_size, false );
+
+	// Import address table within the first section.
+	//
+	auto& text = img.sections[ 0 ];
+	img.iat_size = uint32_t( 8 * ( 1 + random( 64 ) ) );
+	img.iat_rva = text.rva + uint32_t( random( text.length - img.iat_size ) );
+
+	// File contents.
+	//
+	img.file.resize( raw );
+	for ( auto& b : img.file )
+		b = uint8_t( rng() );
+	memcpy( &img.file[ img.sections.back().raw ], dir.data(), dir.size() );
+
+	// Loaded image.
+	//
+	img.mem.resize( rva );
+	for ( auto& s : img.sections )
+		memcpy( &img.mem[ s.rva ], &img.file[ s.raw ], s.length );
+	for ( uint32_t r : img.relocs )
+	{
+		uint64_t v;
+		memcpy( &v, &img.mem[ r ], 8 );
+		v += delta;
+		memcpy( &img.mem[ r ], &v, 8 );
+	}
+	for ( uint32_t i = 0; i != img.iat_size; i++ )
+		img.mem[ img.iat_rva + i ] = uint8_t( rng() );
+	return img;
+}
+
+// Verifies the image with the given buffer size and level.
+//
+static integrity::comparison verify( const synthetic_image& img, size_t buffer_size, simd::level lv, integrity::relocations& relocs )
+{
+	memory_file f{ img.file };
+	std::vector<uint8_t> buffer( buffer_size );
+	if ( !relocs || !relocs->matches( img.sections ) )
+	{
+		relocs = integrity::build_relocations( f, buffer, img.sections, img.reloc_rva, img.reloc_size, img.iat_rva, img.iat_size );
+		CHECK( relocs );
+	}
+	auto result = integrity::compare_sections( f, buffer, img.sections, img.mem.data(), *relocs, lv );
+	CHECK( result.read );
+	return result;
+}
+
+// Checks whether or not the byte is written by the loader.
+//
+static bool is_relocated( const synthetic_image& img, uint32_t rva )
+{
+	auto it = std::upper_bound( img.relocs.begin(), img.relocs.end(), rva );
+	if ( it != img.relocs.begin() && rva < *std::prev( it ) + 8 )
+		return true;
+	return img.iat_rva <= rva && rva < img.iat_rva + img.iat_size;
+}
+
+int main()
+{
+	size_t table_bytes = 0, bitmap_bytes = 0;
+	for ( size_t trial = 0; trial != 200; trial++ )
+	{
+		uint64_t delta = ( rng() & ~0xFFFFull ) | 0xFFFF800000000000;
+		auto img = make_image( delta );
+
+		// Clean images verify at every level and buffer size, with identical hashes.
+		//
+		integrity::relocations relocs;
+		auto reference = verify( img, 0x10000, simd::level::scalar, relocs );
+		CHECK( !reference.patched );
+		CHECK( relocs->rvas.size() <= img.relocs.size() );
+		size_t compared = 0;
+		for ( auto& s : img.sections )
+		{
+			if ( !s.compared )
+				continue;
+			CHECK( reference.file[ compared ].hash == integrity::hash_range( simd::level::scalar, &img.file[ s.raw ], s.length ) );
+			CHECK( reference.memory[ compared ].hash == integrity::hash_range( simd::level::scalar, &img.mem[ s.rva ], s.length ) );
+			bitmap_bytes += ( s.length + 63 ) / 64 * 8;
+			compared++;
+		}
+		table_bytes += relocs->retained_size();
+
+		for ( size_t l = 0; l <= size_t( simd::supported ); l++ )
+		{
+			for ( size_t buffer_size : { 0x1000, 0x2040, 0x10000 } )
+			{
+				integrity::relocations fresh;
+				auto r = verify( img, buffer_size, simd::level( l ), fresh );
+				CHECK( !r.patched );
+				CHECK( r.file == reference.file && r.memory == reference.memory );
+				CHECK( fresh->rvas == relocs->rvas );
+			}
+		}
+
+		// The cached table is reused for the same file at another base.
+		//
+		auto rebased = img;
+		for ( uint32_t r : img.relocs )
+		{
+			uint64_t v;
+			memcpy( &v, &rebased.mem[ r ], 8 );
+			v += 0x10000 * ( 1 + random( 0x1000 ) );
+			memcpy( &rebased.mem[ r ], &v, 8 );
+		}
+		auto cached = relocs;
+		CHECK( !verify( rebased, 0x10000, simd::supported, cached ).patched );
+		CHECK( cached == relocs );
+
+		// A patched byte is detected unless the loader writes it.
+		//
+		auto& s = img.sections[ random( 2 ) ? 0 : 2 ];
+		uint32_t at = s.rva + uint32_t( random( s.length ) );
+		img.mem[ at ] ^= uint8_t( 1 + random( 255 ) );
+		auto patched = verify( img, 0x2040, simd::supported, relocs );
+		CHECK( patched.patched == !is_relocated( img, at ) );
+		CHECK( patched.file == reference.file && patched.memory != reference.memory );
+
+		// Bytes of non-compared sections are ignored.
+		//
+		auto& w = rebased.sections[ 1 ];
+		rebased.mem[ w.rva + random( w.length ) ] ^= 0xFF;
+		CHECK( !verify( rebased, 0x10000, simd::supported, cached ).patched );
+	}
+	printf( "image_compare: ok, relocation tables retain %zu bytes against %zu bytes of bitmaps\n", table_bytes, bitmap_bytes );
+	return 0;
+}
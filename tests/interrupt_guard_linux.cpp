@@ -0,0 +1,188 @@
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "interrupt_guard_linux.hpp"
+
+// Drives faulting instructions through the Linux backend of interrupt_guard.
+// - Privileged instructions raise #GP in user mode and ud2 raises #UD, both are skipped through their registered
+//   lengths. int3 is a trap and resumes after itself.
+// - Faults outside of a guard or at unregistered sites have to reach the disposition that was replaced.
+//
+
+#define CHECK( cond ) \
+	do { if ( !( cond ) ) { fprintf( stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond ); exit( 1 ); } } while ( 0 )
+
+static constexpr size_t fault_count = 20000;
+
+// Registered and unregistered #UD sites.
+//
+[[gnu::noinline]] static void registered_ud2()
+{
+	asm volatile( "probe%=: ud2\n" PROBE_SITE( 2 ) ::: "memory" );
+}
+[[gnu::noinline]] static void unregistered_ud2()
+{
+	asm volatile( "ud2" ::: "memory" );
+}
+
+// Checks whether or not the address is a registered probe site of the given length.
+//
+static bool is_site( uint64_t rip, uint64_t length )
+{
+	for ( auto& site : impl::probe_sites() )
+		if ( uint64_t( site.ip ) == rip && site.length == length )
+			return true;
+	return false;
+}
+
+// Fault records of a single #GP per guard, thousands of times.
+//
+static void test_records()
+{
+	auto t0 = std::chrono::steady_clock::now();
+	for ( size_t n = 0; n != fault_count; n++ )
+	{
+		interrupt_counters ctrs = {};
+		uint64_t before = __rdtsc();
+		{
+			interrupt_guard _g{ &ctrs };
+			probe::read_msr( 0x10 );
+		}
+		CHECK( ctrs.size() == 1 );
+		CHECK( ctrs.dropped == 0 );
+		auto& r = *ctrs.begin();
+		CHECK( r.vector == 13 );
+		CHECK( r.has_error_code() && r.error_code == 0 );
+		CHECK( r.tsc >= before );
+		CHECK( is_site( ctrs.rip_of( r ), 2 ) );
+		CHECK( ctrs.has_exception() && ctrs.count_exceptions() == 1 );
+		CHECK( ctrs.length_hits == 1 && ctrs.length_misses == 0 );
+	}
+	double s = std::chrono::duration<double>( std::chrono::steady_clock::now() - t0 ).count();
+	printf( "records:      %zu faults in %.3f s, %.0f faults/s\n", fault_count, s, fault_count / s );
+}
+
+// Overflow of the record buffer within a single session.
+//
+static void test_overflow()
+{
+	interrupt_counters ctrs = {};
+	{
+		interrupt_session session{ &ctrs };
+		for ( size_t n = 0; n != interrupt_counters::capacity + 8; n++ )
+			registered_ud2();
+	}
+	CHECK( ctrs.size() == interrupt_counters::capacity );
+	CHECK( ctrs.dropped == 8 );
+	CHECK( ctrs.count_exceptions() == interrupt_counters::capacity + 8 );
+	for ( auto& r : ctrs )
+		CHECK( r.vector == 6 && !r.has_error_code() );
+}
+
+// Traps are recorded and resume after the instruction by themselves.
+//
+static void test_trap()
+{
+	interrupt_counters ctrs = {};
+	volatile int after = 0;
+	{
+		interrupt_guard _g{ &ctrs };
+		asm volatile( "int3" ::: "memory" );
+		after = 1;
+	}
+	CHECK( after == 1 );
+	CHECK( ctrs.size() == 1 && ctrs.begin()->vector == 3 );
+	CHECK( ctrs.length_hits == 0 && ctrs.length_misses == 0 );
+}
+
+// Sessions rebind the counters without leaving the guard, the nill counter records nothing.
+//
+static void test_session()
+{
+	interrupt_counters a = {}, b = {};
+	{
+		interrupt_session session{};
+		probe::write_msr( 0x10, 0 );
+		session.bind( &a );
+		probe::read_xcr( 0x7fffffff );
+		probe::read_pmc( 0x7fffffff );
+		session.bind( &b );
+		registered_ud2();
+	}
+	CHECK( impl::nill_counter.size() == 0 );
+	CHECK( a.size() == 2 && b.size() == 1 );
+	CHECK( a.length_hits == 2 && b.length_hits == 1 );
+	CHECK( b.begin()->vector == 6 );
+}
+
+// Signals that are not ours reach the replaced handler.
+//
+static volatile sig_atomic_t chained = 0;
+static void previous_handler( int, siginfo_t*, void* context )
+{
+	chained = chained + 1;
+	( ( ucontext_t* ) context )->uc_mcontext.gregs[ REG_RIP ] += 2;
+}
+static void test_chaining()
+{
+	// Outside of a guard.
+	//
+	unregistered_ud2();
+	CHECK( chained == 1 );
+	registered_ud2();
+	CHECK( chained == 2 );
+
+	// Inside of a guard at a site of unknown length.
+	//
+	interrupt_counters ctrs = {};
+	{
+		interrupt_guard _g{ &ctrs };
+		unregistered_ud2();
+	}
+	CHECK( chained == 3 );
+	CHECK( ctrs.size() == 0 && ctrs.length_misses == 1 );
+}
+
+// A default disposition still terminates the process with the original signal.
+//
+static void test_default_disposition()
+{
+	pid_t pid = fork();
+	CHECK( pid >= 0 );
+	if ( !pid )
+	{
+		{
+			interrupt_counters ctrs = {};
+			interrupt_guard _g{ &ctrs };
+			registered_ud2();
+		}
+		unregistered_ud2();
+		_exit( 0 );
+	}
+	int status = 0;
+	CHECK( waitpid( pid, &status, 0 ) == pid );
+	CHECK( WIFSIGNALED( status ) && WTERMSIG( status ) == SIGILL );
+}
+
+int main()
+{
+	// Fork before the handlers are installed so that the child replaces the default disposition.
+	//
+	test_default_disposition();
+
+	struct sigaction sa = {};
+	sa.sa_sigaction = &previous_handler;
+	sa.sa_flags = SA_SIGINFO;
+	sigemptyset( &sa.sa_mask );
+	sigaction( SIGILL, &sa, nullptr );
+
+	test_records();
+	test_overflow();
+	test_trap();
+	test_session();
+	test_chaining();
+	printf( "interrupt_guard_linux: ok\n" );
+	return 0;
+}
@@ -0,0 +1,69 @@
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include "scoring.hpp"
+
+// Checks the early stopping of the posterior against the tests it would skip.
+// - Each run applies the weights of a sequence of tests in order, stopping once the posterior is conclusive.
+//
+
+#define CHECK( cond ) \
+	do { if ( !( cond ) ) { fprintf( stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond ); exit( 1 ); } } while ( 0 )
+
+// Returns the number of tests run before the posterior became conclusive.
+//
+static size_t run( int32_t prior, int32_t stop_at, const std::vector<int32_t>& weights )
+{
+	scoring::posterior score;
+	score.reset( prior, stop_at );
+	size_t ran = 0;
+	for ( int32_t w : weights )
+	{
+		if ( score.conclusive() )
+			break;
+		score.add( w );
+		ran++;
+	}
+	return ran;
+}
+
+int main()
+{
+	std::vector<int32_t> bare_metal = { -3, -6, -2, -1, -1, -2, -1, -1 };
+	std::vector<int32_t> virtualized = { 30, 12, 20, 40, 15, 25 };
+
+	// A threshold at or below the magnitude of the prior still runs the tests, and bare metal is never concluded early.
+	//
+	for ( int32_t stop_at : { 1, 5, 10 } )
+	{
+		CHECK( run( scoring::default_prior, stop_at, bare_metal ) == bare_metal.size() );
+		scoring::posterior fresh;
+		fresh.reset( scoring::default_prior, stop_at );
+		CHECK( !fresh.conclusive() );
+	}
+	CHECK( run( -100, 50, bare_metal ) == bare_metal.size() );
+
+	// Strong evidence of a hypervisor stops once it moved the posterior the threshold from the prior.
+	//
+	CHECK( run( scoring::default_prior, 10, virtualized ) == 1 );
+	CHECK( run( scoring::default_prior, 40, virtualized ) == 2 );
+	CHECK( run( scoring::default_prior, 60, virtualized ) == 3 );
+	CHECK( run( 20, 25, virtualized ) == 1 );
+
+	// Weak evidence towards bare metal first delays the stop rather than triggering it.
+	//
+	std::vector<int32_t> mixed = { -3, -6, 12, 20, 30 };
+	CHECK( run( scoring::default_prior, 20, mixed ) == 4 );
+
+	// A zero threshold never stops.
+	//
+	CHECK( run( scoring::default_prior, 0, virtualized ) == virtualized.size() );
+
+	// Probabilities are symmetric around even odds.
+	//
+	CHECK( scoring::to_probability( 0 ) == 0.5 );
+	CHECK( std::abs( scoring::to_probability( 10 ) - 10.0 / 11.0 ) < 1e-9 );
+	CHECK( std::abs( scoring::to_probability( -10 ) - 1.0 / 11.0 ) < 1e-9 );
+	printf( "scoring: ok\n" );
+	return 0;
+}
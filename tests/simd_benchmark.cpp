@@ -0,0 +1,79 @@
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <random>
+#include <vector>
+#include "simd.hpp"
+
+// Throughput of the image verification kernels at every supported level on the local machine.
+// - Digests and compare results have to agree across the levels, the process fails otherwise.
+//
+
+#define CHECK( cond ) \
+	do { if ( !( cond ) ) { fprintf( stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond ); exit( 1 ); } } while ( 0 )
+
+static constexpr size_t buffer_size = 1 << 20;
+static constexpr size_t iterations = 256;
+static const char* level_names[] = { "scalar", "sse4.2", "avx2", "avx512" };
+
+// Runs the kernel over the buffer until the iteration count is reached and returns the throughput in GB/s.
+//
+template<typename F>
+static double measure( F&& fn )
+{
+	fn();
+	auto t0 = std::chrono::steady_clock::now();
+	for ( size_t n = 0; n != iterations; n++ )
+		fn();
+	double s = std::chrono::duration<double>( std::chrono::steady_clock::now() - t0 ).count();
+	return ( double( buffer_size ) * iterations ) / s / 1e9;
+}
+
+int main()
+{
+	std::mt19937_64 rng{ 0x5EED };
+	std::vector<uint8_t> a( buffer_size ), b, c;
+	for ( auto& v : a )
+		v = uint8_t( rng() );
+	b = a;
+	c = a;
+
+	// Relocation mask with one 8-byte entry every 64 bytes on average, the masked bytes differ.
+	//
+	std::vector<uint64_t> mask( buffer_size / 64 );
+	for ( size_t i = 0; i + 8 <= buffer_size; i += 8 + rng() % 112 )
+	{
+		for ( size_t j = i; j != i + 8; j++ )
+		{
+			mask[ j / 64 ] |= 1ull << ( j % 64 );
+			b[ j ] ^= 0xFF;
+		}
+	}
+
+	uint64_t digest = 0;
+	volatile bool sink = false;
+	for ( size_t l = 0; l <= size_t( simd::supported ); l++ )
+	{
+		simd::scope vec{ simd::level( l ) };
+		CHECK( simd::equal( vec.lv, a.data(), c.data(), buffer_size ) );
+		CHECK( !simd::equal( vec.lv, a.data(), b.data(), buffer_size ) );
+		CHECK( simd::equal_masked( vec.lv, a.data(), b.data(), mask.data(), buffer_size ) );
+
+		simd::lane_hash h{ vec.lv };
+		h.update( a.data(), buffer_size );
+		if ( !l )
+			digest = h.digest();
+		CHECK( h.digest() == digest );
+
+		double equal = measure( [ & ] { sink = simd::equal( vec.lv, a.data(), c.data(), buffer_size ); } );
+		double masked = measure( [ & ] { sink = simd::equal_masked( vec.lv, a.data(), b.data(), mask.data(), buffer_size ); } );
+		double hash = measure( [ & ]
+		{
+			simd::lane_hash h{ vec.lv };
+			h.update( a.data(), buffer_size );
+			sink = h.digest() & 1;
+		} );
+		printf( "%-7s equal %6.2f GB/s  masked %6.2f GB/s  hash %6.2f GB/s\n", level_names[ l ], equal, masked, hash );
+	}
+	return 0;
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <xstd/intrinsics.hpp>
+#include <mcrt/interface.hpp>
+#include <ia32.hpp>
+#include <ntpp.hpp>
+
+// Timing instrumentation for the exports.
+//
+namespace timing
+{
+	// TSC frequency used to convert cycles to wall time.
+	//
+	inline const uint64_t cycles_per_second = crt::to_cycles( 1s );
+
+	// Conversion helpers.
+	//
+	inline uint64_t to_ns( uint64_t cycles )
+	{
+		return uint64_t( ( unsigned __int128 ) cycles * 1'000'000'000 / cycles_per_second );
+	}
+	inline uint64_t from_us( uint64_t us )
+	{
+		return uint64_t( ( unsigned __int128 ) us * cycles_per_second / 1'000'000 );
+	}
+
+	// Measures the cycles elapsed since construction.
+	//
+	struct stopwatch
+	{
+		uint64_t begin = ia32::read_tsc();
+		FORCE_INLINE uint64_t elapsed() const { return ia32::read_tsc() - begin; }
+	};
+
+	// Writes a timing entry, flagging it if it exceeded its budget or was skipped.
+	//
+	inline cbor::object_t& record( cbor::object_t& section, const char* name, uint64_t cycles, uint64_t budget = 0, bool skipped = false )
+	{
+		cbor::object_t entry = {
+			{ "cycles", cycles },
+			{ "ns",     to_ns( cycles ) },
+		};
+		if ( budget )
+			entry[ "budgetNs" ] = to_ns( budget );
+		if ( budget && cycles > budget )
+			entry[ "overBudget" ] = true;
+		if ( skipped )
+			entry[ "skipped" ] = true;
+		section[ name ] = std::move( entry );
+		return section[ name ].object();
+	}
+};
@@ -1,28 +1,274 @@
 #pragma once
+#include <span>
+#include <atomic>
+#include <algorithm>
 #include <xstd/intrinsics.hpp>
 #include <ia32.hpp>
 #include <mcrt/interface.hpp>
 
 namespace util
 {
+	// Wait strategies, from the most to the least efficient.
+	// - umwait:  UMONITOR/UMWAIT with a TSC deadline, usable with interrupts disabled.
+	// - mwait:   MONITOR/MWAIT, only with interrupts enabled since nothing else would bound the sleep.
+	// - backoff: PAUSE loop with an exponentially growing interval.
+	//
+	enum class wait_mode : uint8_t
+	{
+		umwait,
+		mwait,
+		backoff,
+	};
+	inline const bool has_waitpkg = ( ia32::static_cpuid<7, 0>[ 2 ] >> 5 ) & 1;
+	inline const bool has_monitor = ( ia32::static_cpuid<1, 0>[ 2 ] >> 3 ) & 1;
+
+	// Bounds of the backoff interval in TSC cycles.
+	//
+	static constexpr uint64_t min_backoff = 0x100;
+	static constexpr uint64_t max_backoff = 0x8000;
+
+	// Statistics of the monitored waits.
+	// - Latency is measured from the TSC the writer stamped right before its completion write to the TSC at which the
+	//   waiter observed it, only for writers that stamp one.
+	// - Device writes carry no stamp, they can only be bracketed between the last observation of the condition unmet
+	//   and the first one of it met. The window bounds the latency from above, it is not a measurement of it.
+	// - Waits on commands stamp the TSC of the doorbell write that issued them instead, issue latency is measured from
+	//   it to the wake and covers the service time of the device along with the wake latency.
+	// - Exported by waitStatistics.
+	//
+	struct wait_statistics
+	{
+		std::atomic<uint64_t> waits = 0;
+		std::atomic<uint64_t> wakes = 0;
+		std::atomic<uint64_t> timeouts = 0;
+		std::atomic<uint64_t> latency_samples = 0;
+		std::atomic<uint64_t> total_latency = 0;
+		std::atomic<uint64_t> max_latency = 0;
+		std::atomic<uint64_t> total_window = 0;
+		std::atomic<uint64_t> max_window = 0;
+		std::atomic<uint64_t> issue_samples = 0;
+		std::atomic<uint64_t> total_issue_latency = 0;
+		std::atomic<uint64_t> max_issue_latency = 0;
+
+		static void raise( std::atomic<uint64_t>& max, uint64_t value )
+		{
+			uint64_t prev = max.load();
+			while ( prev < value && !max.compare_exchange_weak( prev, value ) );
+		}
+		void record_wake( uint64_t met_at, uint64_t unmet_at, const volatile uint64_t* written_at )
+		{
+			wakes++;
+			total_window += met_at - unmet_at;
+			raise( max_window, met_at - unmet_at );
+
+			// Stamps from before the wait started belong to an earlier write.
+			//
+			uint64_t stamp = written_at ? *written_at : 0;
+			if ( stamp >= unmet_at && stamp <= met_at )
+			{
+				latency_samples++;
+				total_latency += met_at - stamp;
+				raise( max_latency, met_at - stamp );
+			}
+		}
+		void record_issue( uint64_t met_at, uint64_t issued_at )
+		{
+			if ( !issued_at || issued_at > met_at )
+				return;
+			issue_samples++;
+			total_issue_latency += met_at - issued_at;
+			raise( max_issue_latency, met_at - issued_at );
+		}
+	};
+	inline wait_statistics wait_stats = {};
+
+	// Picks the wait strategy for the current context.
+	//
+	FORCE_INLINE inline wait_mode select_wait_mode( const volatile void* address )
+	{
+		if ( !address )
+			return wait_mode::backoff;
+		if ( has_waitpkg )
+			return wait_mode::umwait;
+		if ( has_monitor && ia32::read_flags().interrupt_enable_flag )
+			return wait_mode::mwait;
+		return wait_mode::backoff;
+	}
+
+	// Arms the monitor on the line of the address.
+	//
+	FORCE_INLINE inline void arm_monitor( wait_mode mode, const volatile void* address )
+	{
+		if ( mode == wait_mode::umwait )
+			asm volatile( "umonitor %0" :: "r" ( address ) : "memory" );
+		else if ( mode == wait_mode::mwait )
+			asm volatile( "monitor" :: "a" ( address ), "c" ( 0 ), "d" ( 0 ) : "memory" );
+	}
+
+	// Sleeps until the monitored line is written, the deadline passes or the backoff interval elapses.
+	//
+	FORCE_INLINE inline void sleep_until( wait_mode mode, uint64_t deadline, uint64_t& backoff, uint64_t tnow )
+	{
+		switch ( mode )
+		{
+			case wait_mode::umwait:
+				asm volatile( "umwait %%ecx" :: "c" ( 0 ), "a" ( uint32_t( deadline ) ), "d" ( uint32_t( deadline >> 32 ) ) : "cc", "memory" );
+				break;
+			case wait_mode::mwait:
+				asm volatile( "mwait" :: "a" ( 0 ), "c" ( 0 ) : "memory" );
+				break;
+			default:
+				ia32::pause_for( backoff, tnow );
+				backoff = std::min( backoff * 2, max_backoff );
+				break;
+		}
+	}
+
+	// Waits until the predicate is satisfied or the duration elapses.
+	// - If an address is given, the predicate is assumed to only change once the line it resides in is written.
+	// - If the writer stamps the TSC before its write, written_at points to the stamp.
+	//
 	template<typename F, typename D>
-	FORCE_INLINE inline bool upause( D duration, F&& func )
+	FORCE_INLINE inline bool upause( D duration, const volatile void* address, F&& func, const volatile uint64_t* written_at = nullptr )
 	{
+		const auto mode = select_wait_mode( address );
 		uint64_t tnow = ia32::read_tsc();
 		const uint64_t end_time = tnow + crt::to_cycles( duration );
-		while( true ) {
-			ia32::pause_for( 0x8000, tnow );
-			if ( func() ) 
-				return true;
+		uint64_t backoff = min_backoff;
+		uint64_t unmet_at = 0;
+		if ( mode != wait_mode::backoff )
+			wait_stats.waits++;
+
+		while ( true ) {
+			// Arm before checking so that a write in between still wakes us.
+			//
+			arm_monitor( mode, address );
+			bool met = func();
 			tnow = ia32::read_tsc();
+			if ( met )
+			{
+				if ( unmet_at && mode != wait_mode::backoff )
+					wait_stats.record_wake( tnow, unmet_at, written_at );
+				return true;
+			}
 			if ( tnow > end_time )
+			{
+				if ( mode != wait_mode::backoff )
+					wait_stats.timeouts++;
 				return false;
+			}
+			unmet_at = tnow;
+			sleep_until( mode, end_time, backoff, tnow );
 		}
 		return false;
 	}
+	template<typename F, typename D>
+	FORCE_INLINE inline bool upause( D duration, F&& func )
+	{
+		return upause( duration, nullptr, std::forward<F>( func ) );
+	}
 	template<typename D>
 	FORCE_INLINE inline bool upause( D duration )
 	{
 		return upause( duration, [ ] () { return false; } );
 	}
-};
\ No newline at end of file
+
+	// Condition polled by the wait multiplexer.
+	//
+	struct wait_condition
+	{
+		bool( *poll )( void* ) = nullptr;
+		void* context = nullptr;
+		uint64_t deadline = 0;                  // Absolute TSC.
+		const volatile void* address = nullptr; // Line written on completion, if known.
+		const volatile uint64_t* written_at = nullptr; // TSC stamped by the writer before completion, if any.
+		uint64_t issued_at = 0;                 // TSC of the write that issued the command, if any.
+
+		// Outcome, completed_at is the TSC at which completion was observed, unmet_at the last one it was not.
+		//
+		bool done = false;
+		bool expired = false;
+		uint64_t completed_at = 0;
+		uint64_t unmet_at = 0;
+	};
+
+	// Makes a condition polling the given member of the object.
+	//
+	template<auto M, typename T, typename D>
+	inline wait_condition wait_on( T& object, D duration, const volatile void* address = nullptr, const volatile uint64_t* written_at = nullptr, uint64_t issued_at = 0 )
+	{
+		return {
+			.poll = [ ] ( void* p ) -> bool { return ( ( ( T* ) p )->*M )(); },
+			.context = &object,
+			.deadline = ia32::read_tsc() + crt::to_cycles( duration ),
+			.address = address,
+			.written_at = written_at,
+			.issued_at = issued_at,
+		};
+	}
+
+	// Waits until every condition either completes or passes its deadline, returns the number of completed ones.
+	// - Conditions are polled round-robin, in between the line of a pending one is monitored if possible. While others
+	//   are pending the sleep is bounded by the backoff interval so that they are still polled, MWAIT has no deadline
+	//   and is only used for the last one.
+	//
+	inline size_t wait_all( std::span<wait_condition> conditions )
+	{
+		uint64_t backoff = min_backoff;
+		for ( auto& c : conditions )
+			wait_stats.waits += c.address != nullptr;
+
+		while ( true ) {
+			size_t pending = 0;
+			wait_condition* monitored = nullptr;
+			for ( auto& c : conditions )
+			{
+				if ( c.done || c.expired )
+					continue;
+				bool met = c.poll( c.context );
+				uint64_t tnow = ia32::read_tsc();
+				if ( met )
+				{
+					c.done = true;
+					c.completed_at = tnow;
+					if ( c.address && c.unmet_at )
+						wait_stats.record_wake( tnow, c.unmet_at, c.written_at );
+					wait_stats.record_issue( tnow, c.issued_at );
+					backoff = min_backoff;
+				}
+				else if ( tnow > c.deadline )
+				{
+					c.expired = true;
+					if ( c.address )
+						wait_stats.timeouts++;
+				}
+				else
+				{
+					pending++;
+					c.unmet_at = tnow;
+					if ( !monitored || ( c.address && !monitored->address ) )
+						monitored = &c;
+				}
+			}
+			if ( !pending )
+				break;
+
+			uint64_t tnow = ia32::read_tsc();
+			uint64_t deadline = monitored->deadline;
+			auto mode = select_wait_mode( monitored->address );
+			if ( pending != 1 && mode == wait_mode::mwait )
+			{
+				mode = wait_mode::backoff;
+			}
+			else if ( pending != 1 && mode == wait_mode::umwait )
+			{
+				deadline = std::min( deadline, tnow + backoff );
+				backoff = std::min( backoff * 2, max_backoff );
+			}
+			arm_monitor( mode, monitored->address );
+			if ( mode == wait_mode::backoff || !monitored->poll( monitored->context ) )
+				sleep_until( mode, deadline, backoff, tnow );
+		}
+		return std::count_if( conditions.begin(), conditions.end(), [ ] ( auto& c ) { return c.done; } );
+	}
+};
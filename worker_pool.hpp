@@ -0,0 +1,179 @@
+#pragma once
+#include <span>
+#include <atomic>
+#include <vector>
+#include <type_traits>
+#include <algorithm>
+#include <ntpp.hpp>
+#include <sdk/ex/api.hpp>
+#include <sdk/ke/api.hpp>
+#include <sdk/nt/work_queue_item_t.hpp>
+#include "upause.hpp"
+
+// Runs a fixed set of tasks on the system worker threads along with the caller.
+// - Tasks are dealt round-robin in the given order into one deque per worker, owners pop from the front so that the
+//   order is respected, idle workers steal from the back of the others.
+// - The caller works as well, so the tasks complete even if a worker item is scheduled late. It only returns once
+//   every queued item exited though, the items run code of the image which may be unloaded right after.
+// - The image is not a driver, so work items cannot hold an object reference on it. Each item holds rundown
+//   protection instead and releases it as a guaranteed tail call, the routine has returned through its epilogue by
+//   the time the release lets the caller go and no code of the image runs on the worker thread afterwards.
+//
+namespace worker_pool
+{
+	// Range of task positions, begin in the low half and end in the high half so that both ends can be claimed with a CAS.
+	//
+	struct alignas( 64 ) deque
+	{
+		std::atomic<uint64_t> range = 0;
+
+		bool pop_front( uint32_t& pos )
+		{
+			uint64_t r = range.load();
+			while ( uint32_t( r ) < uint32_t( r >> 32 ) )
+			{
+				if ( range.compare_exchange_weak( r, r + 1 ) )
+				{
+					pos = uint32_t( r );
+					return true;
+				}
+			}
+			return false;
+		}
+		bool pop_back( uint32_t& pos )
+		{
+			uint64_t r = range.load();
+			while ( uint32_t( r ) < uint32_t( r >> 32 ) )
+			{
+				if ( range.compare_exchange_weak( r, r - ( 1ull << 32 ) ) )
+				{
+					pos = uint32_t( r >> 32 ) - 1;
+					return true;
+				}
+			}
+			return false;
+		}
+	};
+
+	struct state;
+	struct worker
+	{
+		nt::work_queue_item_t item = {};
+		state* owner = nullptr;
+		size_t self = 0;
+	};
+
+	struct state
+	{
+		std::atomic<size_t> done = 0;
+		uint64_t rundown = 0; // EX_RUNDOWN_REF held by each queued item.
+		volatile uint64_t done_at = 0;
+		std::atomic<size_t> steals = 0;
+		std::vector<uint32_t> order = {};
+		std::vector<deque> deques = {};
+		std::vector<worker> workers = {};
+		void( *fn )( void*, size_t, size_t ) = nullptr;
+		void* ctx = nullptr;
+
+		// Runs tasks until every deque is empty, starting with its own.
+		//
+		void work( size_t self )
+		{
+			uint32_t pos;
+			while ( true )
+			{
+				bool found = deques[ self ].pop_front( pos );
+				for ( size_t i = 1; !found && i != deques.size(); i++ )
+				{
+					found = deques[ ( self + i ) % deques.size() ].pop_back( pos );
+					steals += found;
+				}
+				if ( !found )
+					return;
+				fn( ctx, order[ pos ], self );
+				done_at = ia32::read_tsc();
+				++done;
+			}
+		}
+	};
+
+	// Routine of the work items, declared with the type of the release so that it can be tail called.
+	//
+	inline void worker_routine( void* p )
+	{
+		auto* wk = ( worker* ) p;
+		wk->owner->work( wk->self );
+		auto* release = ( void( * )( void* ) ) &ex::release_rundown_protection;
+		[[clang::musttail]] return release( &wk->owner->rundown );
+	}
+
+	// Statistics of the last run.
+	//
+	struct statistics
+	{
+		size_t workers = 0;
+		size_t steals = 0;
+	};
+
+	// Runs fn( index ) or fn( index, worker ) for every index in the given order, max_workers of 0 uses every processor.
+	// - Worker indices are below the active processor count.
+	//
+	template<typename F>
+	inline statistics run( std::span<const uint32_t> order, size_t max_workers, F&& fn )
+	{
+		size_t workers = ke::query_active_processor_count( nullptr );
+		if ( max_workers )
+			workers = std::min( workers, max_workers );
+		workers = std::clamp<size_t>( workers, 1, std::max<size_t>( order.size(), 1 ) );
+
+		auto* s = new state{};
+		s->fn = [ ] ( void* ctx, size_t index, size_t worker )
+		{
+			auto& f = *( std::remove_reference_t<F>* ) ctx;
+			if constexpr ( std::is_invocable_v<F, size_t, size_t> )
+				f( index, worker );
+			else
+				f( index );
+		};
+		s->ctx = &fn;
+
+		// Deal the tasks, worker w owns positions w, w + workers, ... laid out contiguously.
+		//
+		std::vector<uint32_t> dealt;
+		dealt.reserve( order.size() );
+		s->deques = std::vector<deque>( workers );
+		for ( size_t w = 0; w != workers; w++ )
+		{
+			uint64_t begin = dealt.size();
+			for ( size_t i = w; i < order.size(); i += workers )
+				dealt.push_back( order[ i ] );
+			s->deques[ w ].range = begin | ( uint64_t( dealt.size() ) << 32 );
+		}
+		s->order = std::move( dealt );
+
+		// Queue the workers, the caller takes the first deque.
+		//
+		s->workers.resize( workers );
+		for ( size_t w = 1; w != workers; w++ )
+		{
+			auto& wk = s->workers[ w ];
+			wk.owner = s;
+			wk.self = w;
+			wk.item.worker_routine = &worker_routine;
+			wk.item.parameter = &wk;
+			ex::acquire_rundown_protection( &s->rundown );
+			ex::queue_work_item( &wk.item, nt::work_queue_type_t::delayed_work_queue );
+		}
+		s->work( 0 );
+
+		// Wait for the tasks claimed by the workers, then for the items that have yet to start or return.
+		//
+		while ( s->done.load() != order.size() )
+			util::upause( 1ms, &s->done, [ & ] () { return s->done.load() == order.size(); }, &s->done_at );
+		ex::wait_for_rundown_protection_release( &s->rundown );
+
+		statistics result = { workers, s->steals.load() };
+		delete s;
+		return result;
+	}
+};